@@ -1,3 +1,19 @@
-E:/VulkanSDK/1.0.65.1/Bin/glslangValidator.exe -V shader.vert
-E:/VulkanSDK/1.0.65.1/Bin/glslangValidator.exe -V shader.frag
-pause
\ No newline at end of file
+@echo off
+if not "%~2"=="" set "VULKAN_SDK=%~2"
+if "%VULKAN_SDK%"=="" (
+	echo compile.bat: VULKAN_SDK is not set, install the Vulkan SDK or pass its path as the second argument 1>&2
+	exit /b 1
+)
+set "GLSLANG=%VULKAN_SDK%\Bin\glslangValidator.exe"
+if not exist "%GLSLANG%" (
+	echo compile.bat: no glslangValidator at "%GLSLANG%", check VULKAN_SDK 1>&2
+	exit /b 1
+)
+
+"%GLSLANG%" -V shader.vert || exit /b 1
+"%GLSLANG%" -V shader.frag || exit /b 1
+"%GLSLANG%" -V feedback.frag -o feedback.spv || exit /b 1
+"%GLSLANG%" -V shader.vert --vn vert_spv -o vert.spv.h || exit /b 1
+"%GLSLANG%" -V shader.frag --vn frag_spv -o frag.spv.h || exit /b 1
+"%GLSLANG%" -V feedback.frag --vn feedback_spv -o feedback.spv.h || exit /b 1
+if not "%1"=="nopause" pause
\ No newline at end of file
@@ -0,0 +1,54 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+const uint MAX_MATERIALS = 64; //must match MAX_MATERIALS in TriangleBasicsApp.cpp
+const uint MAX_VIRTUAL_TEXTURES = 16; //must match the VT_ constants in TriangleBasicsApp.cpp
+const uint NO_VIRTUAL_TEXTURE = 0xFFFFFFFFu;
+const uint VT_INVALID_KEY = 0xFFFFFFFFu;
+const uint VT_PAGE_CONTENT = 128;
+const float VT_FEEDBACK_LOD_BIAS = 3.0; //log2 of VT_FEEDBACK_DIVISOR - this pass runs at 1/8 size so its derivatives come out 8x too big
+
+struct Material {
+	vec4 uvTransform;
+	uint layer;
+	uint virtualTexture;
+	float tailLod;
+	float maxLod;
+};
+
+struct VirtualTextureInfo {
+	vec4 size; //xy size in texels, z mip count
+};
+
+layout(location = 1) in vec2 fragTexCoords;
+layout(location = 3) flat in uint fragMaterial;
+
+layout(binding = 2) uniform MaterialTable {
+	Material materials[MAX_MATERIALS];
+} materialTable;
+
+layout(binding = 3) uniform VirtualTextureTable {
+	VirtualTextureInfo textures[MAX_VIRTUAL_TEXTURES];
+} vtTable;
+
+layout(location = 0) out uint outKey; //page this pixel wants, read back by updateVirtualTextures
+
+void main() {
+	vec2 dx = dFdx(fragTexCoords); //taken before branching, derivatives are undefined in non-uniform control flow
+	vec2 dy = dFdy(fragTexCoords);
+
+	uint vt = materialTable.materials[fragMaterial].virtualTexture;
+
+	if (vt == NO_VIRTUAL_TEXTURE) {
+		outKey = VT_INVALID_KEY;
+		return;
+	}
+
+	VirtualTextureInfo info = vtTable.textures[vt];
+	vec2 texelCoords = fract(fragTexCoords) * info.size.xy;
+	float lod = clamp(log2(max(length(dx * info.size.xy), length(dy * info.size.xy))) - VT_FEEDBACK_LOD_BIAS, 0.0, info.size.z - 1.0);
+	uint mip = uint(lod);
+	uvec2 page = uvec2(texelCoords / float(VT_PAGE_CONTENT << mip));
+
+	outKey = (vt << 28) | (mip << 24) | (page.y << 12) | page.x; //same layout as packPageKey
+}
@@ -1,23 +1,123 @@
 #version 450
 #extension GL_ARB_separate_shader_objects : enable
 
+const uint MAX_MATERIALS = 64; //must match MAX_MATERIALS in TriangleBasicsApp.cpp
+const uint MAX_VIRTUAL_TEXTURES = 16; //must match the VT_ constants in TriangleBasicsApp.cpp
+const uint NO_VIRTUAL_TEXTURE = 0xFFFFFFFFu;
+const uint VT_PAGE_CONTENT = 128;
+const uint VT_PAGE_BORDER = 4;
+const uint VT_PAGE_SIZE = VT_PAGE_CONTENT + 2 * VT_PAGE_BORDER;
+const uint VT_CACHE_PAGES = 16;
+
+const uint LIGHTING_CONSTANT = 0; //must match LightingMode in TriangleBasicsApp.cpp
+const uint LIGHTING_UNIFORM = 1;
+
+layout(constant_id = 0) const uint LIGHTING_MODE = LIGHTING_UNIFORM; //the branch on it folds away when the pipeline is compiled
+layout(constant_id = 1) const float AMBIENT_R = 0.2; //LIGHTING_CONSTANT values, the host fills them in from its lighting
+layout(constant_id = 2) const float AMBIENT_G = 0.2;
+layout(constant_id = 3) const float AMBIENT_B = 0.4;
+layout(constant_id = 4) const float LIGHT_R = 0.5;
+layout(constant_id = 5) const float LIGHT_G = 0.5;
+layout(constant_id = 6) const float LIGHT_B = 0.9;
+layout(constant_id = 7) const float LIGHT_DIR_X = 0.0; //normalised on the host
+layout(constant_id = 8) const float LIGHT_DIR_Y = 0.780869;
+layout(constant_id = 9) const float LIGHT_DIR_Z = -0.624695;
+
+struct Material {
+	vec4 uvTransform; //xy scale, zw offset of the texture's rect inside its layer
+	uint layer; //array layer holding the texels
+	uint virtualTexture; //streamed texture to sample instead, NO_VIRTUAL_TEXTURE for the array
+	float tailLod; //texture mip the array holds at its level 0, finer ones live in the material's detail image
+	float maxLod; //coarsest array level whose atlas gutter is intact
+};
+
+struct VirtualTextureInfo {
+	vec4 size; //xy size in texels, z mip count
+};
+
 layout(location = 0) in vec3 fragColor;
 layout(location = 1) in vec2 fragTexCoords;
 layout(location = 2) in vec4 fragNormal;
+layout(location = 3) flat in uint fragMaterial;
+
+layout(binding = 0) uniform UniformBufferObject {
+	mat4 view;
+	mat4 viewProj;
+	vec4 ambient; //LIGHTING_UNIFORM values
+	vec4 lightIntensity;
+	vec4 lightDirection;
+} ubo;
+
+layout(binding = 1) uniform sampler2DArray texSampler;
+
+layout(binding = 2) uniform MaterialTable {
+	Material materials[MAX_MATERIALS];
+} materialTable;
 
-layout(binding = 1) uniform sampler2D texSampler;
+layout(binding = 3) uniform VirtualTextureTable {
+	VirtualTextureInfo textures[MAX_VIRTUAL_TEXTURES];
+} vtTable;
+
+layout(binding = 4) uniform sampler2D vtCache; //physical page cache
+layout(binding = 5) uniform usampler2DArray vtIndirection; //per texture and mip, where each page lives in the cache
+layout(binding = 6) uniform texture2D detailImages[MAX_MATERIALS]; //streamed mips finer than the tail, indexed by material which is the same across a draw
+layout(binding = 7) uniform sampler detailSampler;
 
 layout(location = 0) out vec4 outColor;
 
+vec4 sampleVirtual(uint vt, vec2 uv, vec2 dx, vec2 dy) {
+	VirtualTextureInfo info = vtTable.textures[vt];
+	vec2 texelCoords = fract(uv) * info.size.xy; //repeat like the array sampler
+	float lod = clamp(log2(max(length(dx * info.size.xy), length(dy * info.size.xy))), 0.0, info.size.z - 1.0);
+	uint mip = uint(lod);
+
+	uint entry = texelFetch(vtIndirection, ivec3(texelCoords / float(VT_PAGE_CONTENT << mip), vt), int(mip)).r; //falls back to the closest resident ancestor
+	uint residentMip = (entry >> 16) & 0xFFu;
+	vec2 cachePage = vec2(entry & 0xFFu, (entry >> 8) & 0xFFu);
+	vec2 inPage = fract(texelCoords / float(VT_PAGE_CONTENT << residentMip));
+
+	vec2 cacheCoords = (cachePage * float(VT_PAGE_SIZE) + float(VT_PAGE_BORDER) + inPage * float(VT_PAGE_CONTENT)) / float(VT_CACHE_PAGES * VT_PAGE_SIZE);
+	return textureLod(vtCache, cacheCoords, 0.0);
+}
+
 void main() {
 
-	//just hardcoding to test, will abstract out to the host side app later
+	vec3 ambient;
+	vec3 dirLightInt;
+	vec3 dirLightDir;
+
+	if (LIGHTING_MODE == LIGHTING_CONSTANT) {
+		ambient = vec3(AMBIENT_R, AMBIENT_G, AMBIENT_B);
+		dirLightInt = vec3(LIGHT_R, LIGHT_G, LIGHT_B);
+		dirLightDir = vec3(LIGHT_DIR_X, LIGHT_DIR_Y, LIGHT_DIR_Z);
+	} else {
+		ambient = ubo.ambient.xyz;
+		dirLightInt = ubo.lightIntensity.xyz;
+		dirLightDir = ubo.lightDirection.xyz;
+	}
 
-	vec3 ambient =  vec3(0.2, 0.2, 0.4);
-	vec3 dirLightInt =  vec3(0.5, 0.5, 0.9);
-	vec3 dirLightDir = normalize(vec3(0.0, 5.0, -4.0));
 	vec3 surfaceNorm = normalize(fragNormal.xyz);
-	vec4 texel = texture(texSampler, fragTexCoords);
+
+	Material material = materialTable.materials[fragMaterial];
+	vec2 dx = dFdx(fragTexCoords); //taken before branching, derivatives are undefined in non-uniform control flow
+	vec2 dy = dFdy(fragTexCoords);
+	vec4 texel;
+
+	if (material.virtualTexture != NO_VIRTUAL_TEXTURE) {
+		texel = sampleVirtual(material.virtualTexture, fragTexCoords, dx, dy);
+	} else {
+		vec2 atlasCoords = material.uvTransform.zw + fract(fragTexCoords) * material.uvTransform.xy; //wrap inside the texture's own rect so repeating uvs stay out of atlas neighbours
+		vec2 layerDx = dx * material.uvTransform.xy;
+		vec2 layerDy = dy * material.uvTransform.xy;
+		vec2 layerSize = vec2(textureSize(texSampler, 0).xy);
+		float lod = log2(max(length(layerDx * layerSize), length(layerDy * layerSize)));
+		if (lod < 0.0 && material.tailLod > 0.0) { //finer than the tail, the detail image holds what has streamed in and clamps to it
+			texel = textureGrad(sampler2D(detailImages[fragMaterial], detailSampler), fragTexCoords, dx, dy);
+		} else {
+			float lodScale = exp2(clamp(lod, 0.0, material.maxLod) - lod); //narrow the gradients so the lookup never lands on a level where atlas neighbours touch
+			texel = textureGrad(texSampler, vec3(atlasCoords, float(material.layer)), layerDx * lodScale, layerDy * lodScale);
+		}
+	}
 
 	vec3 lightIntense = ambient + dirLightInt * max(dot(surfaceNorm, dirLightDir), 0.0); //simple Phong lighting
 
@@ -9,22 +9,32 @@ layout(location = 0) in vec3 inPosition;
 layout(location = 1) in vec3 inColor;
 layout(location = 2) in vec2 inTexCoord;
 layout(location = 3) in vec3 normal;
+layout(location = 4) in uint inMaterial;
 
 layout(location = 0) out vec3 fragColor;
 layout(location = 1) out vec2 fragTexCoord;
 layout(location = 2) out vec4 fragNormal;
+layout(location = 3) flat out uint fragMaterial;
 
 layout(binding = 0) uniform UniformBufferObject {
-	mat4 model;
-	mat4 view;
-	mat4 mvp;
+	mat4 view; //includes the scene's spin
+	mat4 viewProj;
+	vec4 ambient; //lighting, read by shader.frag
+	vec4 lightIntensity;
+	vec4 lightDirection;
 } ubo;
 
+layout(push_constant) uniform DrawPushConstants { //per draw, must match DrawPushConstants in TriangleBasicsApp.cpp
+	mat4 model;
+	mat4 normalModel; //inverse-transpose of model
+} draw;
+
 void main(){
 
 
-	gl_Position = ubo.mvp *  vec4(inPosition, 1.0);
-	fragNormal = ubo.view * ubo.model * vec4(normal, 1.0);
+	gl_Position = ubo.viewProj * draw.model * vec4(inPosition, 1.0);
+	fragNormal = vec4(mat3(ubo.view) * mat3(draw.normalModel) * normal, 0.0); //view is rigid, so its rotation alone carries normals; w=0 keeps translation out
 	fragColor = inColor;
 	fragTexCoord = inTexCoord;
+	fragMaterial = inMaterial;
 }
\ No newline at end of file
@@ -1,5 +1,6 @@
 #define GLFW_INCLUDE_VULKAN //Turn on glfw vulkan support
 #include <GLFW\glfw3.h> //glfw header
+#include <shaderc/shaderc.hpp> //glsl compiler library from the Vulkan SDK, compiles shaders in process for hot reload
 
 #include <iostream> 
 #include <vector>
@@ -9,6 +10,23 @@
 #include <algorithm>
 #include <fstream>
 #include <unordered_map>
+#include <map>
+#include <memory>
+#include <unordered_set>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <tuple>
+#include <atomic>
+#include <exception>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #define GLM_FORCE_RADIANS
 #define GLM_FORCE_DEPTH_ZERO_TO_ONE //use normalized coordinates for depth
@@ -22,6 +40,10 @@
 #define STB_IMAGE_IMPLEMENTATION //include stb function definitions
 #include <stb_image.h>
 
+#include "Shaders/vert.spv.h" //SPIR-V compiled into the binary by Shaders/compile.bat, the project's pre-build step
+#include "Shaders/frag.spv.h"
+#include "Shaders/feedback.spv.h"
+
 #define TINYOBJLOADER_IMPLEMENTATION
 #include <tiny_obj_loader.h> //lightweight obj file loader
 
@@ -32,11 +54,64 @@ const int HEIGHT = 600; //window initial height
 
 const std::string MODEL_PATH_ROOT = "models/";
 const std::string TEXTURE_PATH_ROOT = "textures/";
+const std::string PIPELINE_CACHE_FILE = "pipeline.cache"; //driver's compiled pipelines from the last run, PIPELINE_CACHE overrides the path
+const int SHADER_WATCH_INTERVAL_MS = 250; //how often hot reload checks the shader sources, SHADER_HOT_RELOAD=0/1 turns it off/on (on in debug)
+
+const uint32_t DEFAULT_FRAMES_IN_FLIGHT = 2; //frames the CPU may record ahead of the GPU, FRAMES_IN_FLIGHT overrides (1 to MAX_FRAMES_IN_FLIGHT)
+const uint32_t MAX_FRAMES_IN_FLIGHT = 3;
+const VkDeviceSize DEVICE_MEMORY_BLOCK_SIZE = 64 * 1024 * 1024; //memory blocks the allocator sub-allocates from, anything over half of this gets a dedicated allocation
+const VkDeviceSize DEFAULT_UPLOAD_BYTES_PER_FRAME = 8 * 1024 * 1024; //streamed bytes copied per frame across mips and pages, UPLOAD_BUDGET_KB overrides
+const uint32_t DEFAULT_UPLOAD_COPIES_PER_FRAME = 32; //streamed copies per frame, UPLOAD_COPIES overrides
+const VkMemoryPropertyFlags UNIFIED_MEMORY_FLAGS = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT; //memory the GPU reads at full speed and the host writes directly
+const VkDeviceSize STAGING_BUFFER_SIZE = 64 * 1024 * 1024; //size of the persistently mapped staging ring - uploads bigger than half of this fall back to a temporary buffer
+
+const std::string DEFAULT_TEXTURE = "Ancient Ugandan.png"; //material 0 - used by any face whose material has no texture we can load
+const uint32_t MAX_MATERIALS = 64; //size of the material table - must match MAX_MATERIALS in shader.frag
+const uint32_t ATLAS_PADDING = 2; //empty texels between atlas neighbours at every mip that gets sampled, so filtering doesn't pull in the next texture
+const uint32_t ATLAS_MIN_ALIGN_MIP = 3; //atlas rects keep their gutters for at least this many levels below the tail
+
+const uint32_t MIP_STREAM_RESIDENT_SIZE = 64; //mips this size and smaller live in the atlas for good, finer ones stream into the texture's detail image once they're big enough on screen
+const VkDeviceSize DEFAULT_TEXTURE_BUDGET = 256 * 1024 * 1024; //bytes of streamed mips kept resident in detail images, TEXTURE_BUDGET_MB overrides
+const uint32_t MIP_FILE_MAGIC = 0x3250494D; //"MIP2"
+
+const uint32_t VIRTUAL_TEXTURE_MIN_SIZE = 8192; //textures this wide or tall are streamed page by page instead of packed into the texture array
+const uint32_t MAX_VIRTUAL_TEXTURES = 16; //texture id gets 4 bits of a page key - must match MAX_VIRTUAL_TEXTURES in the shaders
+const uint32_t NO_VIRTUAL_TEXTURE = 0xFFFFFFFF; //material reads from the texture array
+const uint32_t VT_PAGE_CONTENT = 128; //texels of payload per page side - must match VT_PAGE_CONTENT in the shaders
+const uint32_t VT_PAGE_BORDER = 4; //texels borrowed from the neighbouring pages on each side so filtering never reads across a page edge
+const uint32_t VT_PAGE_SIZE = VT_PAGE_CONTENT + 2 * VT_PAGE_BORDER; //page side as stored on disk and in the physical cache
+const VkDeviceSize VT_PAGE_BYTES = VT_PAGE_SIZE * VT_PAGE_SIZE * 4; //RGBA8
+const uint32_t VT_MAX_PAGES_PER_SIDE = 4096; //page x and y get 12 bits of a page key
+const uint32_t VT_CACHE_PAGES = 16; //physical cache is VT_CACHE_PAGES x VT_CACHE_PAGES pages (~19MB) however big the sources are - must match the shaders
+const uint32_t VT_FEEDBACK_DIVISOR = 8; //feedback pass runs at 1/8 of the swapchain size - must match VT_FEEDBACK_LOD_BIAS in feedback.frag
+const uint32_t VT_INVALID_KEY = 0xFFFFFFFF; //no page - feedback clear value and empty cache slots
+const uint32_t VT_FILE_MAGIC = 0x32505456; //"VTP2"
+
+struct UniformBufferObject { //shader global object, what every draw shares - per draw transforms are push constants
+	glm::mat4 view; //view matrix, with the scene's spin
+	glm::mat4 viewProj; //projection * view
+	glm::vec4 ambient; //lighting, only read by the LIGHTING_UNIFORM variant
+	glm::vec4 lightIntensity;
+	glm::vec4 lightDirection; //normalised
+};
+
+enum LightingMode : uint32_t { //constant_id 0 in shader.frag
+	LIGHTING_CONSTANT = 0, //light values folded into the pipeline as specialization constants
+	LIGHTING_UNIFORM = 1 //light values read from the ubo, any lighting without a recompile
+};
 
-struct UniformBufferObject { //shader global object
-	glm::mat4 model; //model matrix
-	glm::mat4 view; //view matrix
-	glm::mat4 proj; //projection matrix
+struct LightingParams { //one ambient term and one directional light
+	glm::vec3 ambient;
+	glm::vec3 intensity;
+	glm::vec3 direction; //towards the light, doesn't need to be normalised
+};
+
+const LightingParams DEFAULT_LIGHTING = { glm::vec3(0.2f, 0.2f, 0.4f), glm::vec3(0.5f, 0.5f, 0.9f), glm::vec3(0.0f, 5.0f, -4.0f) };
+
+const LightingParams LIGHTING_PRESETS[] = { //L cycles through them
+	DEFAULT_LIGHTING,
+	{ glm::vec3(0.25f, 0.15f, 0.1f), glm::vec3(0.9f, 0.55f, 0.3f), glm::vec3(-5.0f, 1.0f, 0.0f) }, //low warm sun
+	{ glm::vec3(0.05f, 0.05f, 0.12f), glm::vec3(0.2f, 0.25f, 0.45f), glm::vec3(2.0f, 5.0f, 2.0f) } //moonlight
 };
 
 struct Vertex { //shader vertex information
@@ -44,6 +119,7 @@ struct Vertex { //shader vertex information
 	glm::vec3 color; //color vector, RBG, alpha hardcoded to 1 in shader for now
 	glm::vec2 tex;
 	glm::vec3 normal;
+	uint32_t material; //index into the material table, picks the texture layer and uv rect
 	//data is interleaved in memory i.e <[pos][color][tex]><[pos][color][tex]>...
 	//                                  ^-----stride-----^
 
@@ -56,8 +132,8 @@ struct Vertex { //shader vertex information
 		return bindingDes; //return the struct
 	}
 
-	static std::array<VkVertexInputAttributeDescription, 4> getAttributeDescriptions() { //generate an array of structs describing our vertex struct
-		std::array<VkVertexInputAttributeDescription, 4> attDes = {};
+	static std::array<VkVertexInputAttributeDescription, 5> getAttributeDescriptions() { //generate an array of structs describing our vertex struct
+		std::array<VkVertexInputAttributeDescription, 5> attDes = {};
 
 		attDes[0].binding = 0; //binding, must match appropriate VkVertexInputBindingDescription
 		attDes[0].location = 0; //location specified in shader for i-th data member - 0:0
@@ -79,11 +155,16 @@ struct Vertex { //shader vertex information
 		attDes[3].format = VK_FORMAT_R32G32B32_SFLOAT; //specify data vector size using color flags - three 32 bit signed float
 		attDes[3].offset = offsetof(Vertex, normal); //offset to find color elements <[pos][color][tex]^[normal]><[pos][color][tex]^[normal]>...
 
+		attDes[4].binding = 0; //binding, must match appropriate VkVertexInputBindingDescription
+		attDes[4].location = 4; //location specified in shader for i-th data member - 0:4
+		attDes[4].format = VK_FORMAT_R32_UINT; //one 32 bit unsigned int, read as a uint in the shader
+		attDes[4].offset = offsetof(Vertex, material); //offset to find material elements <[pos][color][tex][normal]^[material]>...
+
 		return attDes; //return the struct
 	}
 
 	bool operator==(const Vertex &other) const {
-		return pos == other.pos && color == other.color && tex == other.tex;
+		return pos == other.pos && color == other.color && tex == other.tex && material == other.material;
 	}
 
 };
@@ -93,14 +174,487 @@ namespace std {
 		size_t operator()(Vertex const& vertex) const {
 			return ((hash<glm::vec3>()(vertex.pos) ^
 				(hash<glm::vec3>()(vertex.color) << 1)) >> 1) ^
-				(hash<glm::vec2>()(vertex.tex) << 1);
+				(hash<glm::vec2>()(vertex.tex) << 1) ^
+				(hash<uint32_t>()(vertex.material) << 2);
 		}
 	};
 }
 
+struct Material { //where a texture's tail ended up in the packed texture array - mirrors Material in shader.frag (std140)
+	glm::vec4 uvTransform = glm::vec4(1.0f, 1.0f, 0.0f, 0.0f); //xy scale, zw offset of the texture's rect inside its layer
+	uint32_t layer = 0; //array layer holding the texels
+	uint32_t virtualTexture = NO_VIRTUAL_TEXTURE; //streamed texture to sample instead of the array
+	float tailLod = 0.0f; //texture mip at atlas level 0 - anything finer comes from the material's detail image
+	float maxLod = 0.0f; //coarsest atlas level whose gutter is intact, the shader never samples above it
+};
+
+struct PackedTexture { //placement of one source texture's tail inside the texture array, and how much of the rest is streamed in
+	std::string fileName;
+	uint32_t width = 0;
+	uint32_t height = 0;
+	uint32_t layer = 0; //array layer the tail was packed into
+	uint32_t x = 0; //texel offset of the tail inside the layer, at atlas level 0
+	uint32_t y = 0;
+	uint32_t material = 0; //material table entry to fill in once placed
+	std::string mipPath; //every mip level back to back, built from the source on first use
+	uint32_t mipCount = 1; //full chain down to 1x1
+	uint32_t tailMip = 0; //first mip of the always resident tail, what atlas level 0 holds
+	uint32_t alignMip = 0; //rect is aligned and padded so its gutter survives down to this mip
+	uint32_t residentMip = 0; //finest mip currently in the texture's detail image, tailMip when only the tail is in
+	std::vector<uint64_t> lastNeeded; //per mip, the streaming frame it was last wanted on screen
+};
+
+struct SourceStamp { //size and modification time of a source file, what its derived caches check to see if it changed
+	uint64_t size;
+	int64_t modified;
+};
+
+struct MipFileHeader { //start of a .mips file - levels follow from mip 0 down, tightly packed RGBA8
+	uint32_t magic;
+	uint32_t width;
+	uint32_t height;
+	uint32_t mipCount;
+	SourceStamp source; //the image the levels were built from
+};
+
+struct LoadedMip { //mip level read by the loader thread, waiting to be copied into a detail image
+	uint32_t key = 0; //texture index << 8 | mip
+	std::vector<unsigned char> texels; //empty if the read failed
+};
+
+struct MaterialBounds { //geometry drawn with a material, used to estimate how big its texture ends up on screen
+	glm::vec3 min = glm::vec3(std::numeric_limits<float>::max());
+	glm::vec3 max = glm::vec3(-std::numeric_limits<float>::max());
+	double worldArea = 0.0; //summed triangle area in model space
+	double uvArea = 0.0; //summed triangle area in uv space
+};
+
+struct VirtualTextureHeader { //start of a .vtpages file - pages follow mip by mip, row by row
+	uint32_t magic;
+	uint32_t width;
+	uint32_t height;
+	uint32_t mipCount;
+	uint32_t pageContent;
+	uint32_t pageBorder;
+	SourceStamp source; //the image the pages were cut from
+};
+
+struct VirtualTexture { //a texture too big to keep resident, streamed through the page cache
+	std::string pagePath; //tiled page file on disk
+	uint32_t width = 0;
+	uint32_t height = 0;
+	uint32_t mipCount = 0; //mip m pages span VT_PAGE_CONTENT << m source texels, the last mip is a single page
+	std::vector<uint32_t> pagesX; //page grid per mip
+	std::vector<uint32_t> pagesY;
+	std::vector<uint64_t> firstPage; //file index of each mip's first page
+	bool indirectionDirty = true; //residency changed since the indirection texture was last uploaded
+};
+
+struct VirtualTextureInfo { //per virtual texture constants - mirrors VirtualTextureInfo in the shaders (std140)
+	glm::vec4 size; //xy size in texels, z mip count
+};
+
+struct LoadedPage { //page read by the loader thread, waiting to be copied into the cache
+	uint32_t key = VT_INVALID_KEY;
+	std::vector<unsigned char> texels; //empty if the read failed
+};
+
+inline uint32_t packPageKey(uint32_t texture, uint32_t mip, uint32_t x, uint32_t y) { //same layout feedback.frag writes
+	return (texture << 28) | (mip << 24) | (y << 12) | x;
+}
+
+inline uint32_t pageKeyTexture(uint32_t key) { return key >> 28; }
+inline uint32_t pageKeyMip(uint32_t key) { return (key >> 24) & 0xF; }
+inline uint32_t pageKeyY(uint32_t key) { return (key >> 12) & 0xFFF; }
+inline uint32_t pageKeyX(uint32_t key) { return key & 0xFFF; }
+
+struct MemoryBlock { //one vkAllocateMemory carved up by DeviceMemoryAllocator
+	VkDeviceMemory memory = VK_NULL_HANDLE;
+	VkDeviceSize size = 0;
+	VkDeviceSize used = 0; //bytes handed out, the block is released once this drops to 0 and a spare already exists
+	unsigned char *mapped = nullptr; //whole block mapped once if the memory type is host visible
+	uint32_t memoryType = 0;
+	bool linear = true; //buffers and linear images - optimal images get blocks of their own so bufferImageGranularity never has to split a page between the two
+	std::map<VkDeviceSize, VkDeviceSize> freeRanges; //offset -> size, adjacent ranges are always merged
+};
+
+struct MemoryAllocation { //range of device memory handed out by DeviceMemoryAllocator - bind with memory and offset
+	VkDeviceMemory memory = VK_NULL_HANDLE;
+	VkDeviceSize offset = 0;
+	VkDeviceSize size = 0;
+	void *mapped = nullptr; //host pointer to offset when the memory is host visible, valid until freed
+	MemoryBlock *block = nullptr; //null for dedicated allocations
+};
+
+struct MemoryStats {
+	uint32_t blockCount = 0;
+	uint32_t dedicatedCount = 0;
+	uint32_t allocationCount = 0; //live allocations, sub-allocated and dedicated
+	VkDeviceSize bytesReserved = 0; //device memory held in blocks and dedicated allocations
+	VkDeviceSize bytesUsed = 0; //of that, what resources asked for
+};
+
+class DeviceMemoryAllocator { //sub-allocates buffers and images from large per memory type blocks so the app stays far below maxMemoryAllocationCount
+public:
+	void init(VkDevice logicalDevice, VkPhysicalDevice physicalDevice) {
+		device = logicalDevice;
+		vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memProps);
+
+		VkPhysicalDeviceProperties props;
+		vkGetPhysicalDeviceProperties(physicalDevice, &props);
+		maxAllocations = props.limits.maxMemoryAllocationCount;
+	}
+
+	MemoryAllocation allocate(const VkMemoryRequirements &requirements, uint32_t memoryType, bool linear, bool dedicated = false) {
+		MemoryAllocation allocation;
+		allocation.size = requirements.size;
+
+		if (dedicated || requirements.size > blockSize(memoryType) / 2) { //big resources get memory of their own rather than hogging a block
+			allocation.memory = allocateMemory(requirements.size, memoryType);
+			allocation.mapped = mapIfHostVisible(allocation.memory, memoryType);
+			statistics.dedicatedCount++;
+			statistics.bytesReserved += requirements.size;
+		} else {
+			MemoryBlock *block = nullptr;
+			VkDeviceSize offset = 0;
+
+			for (auto &candidate : blocks) {
+				if (candidate->memoryType == memoryType && candidate->linear == linear && suballocate(*candidate, requirements, offset)) {
+					block = candidate.get();
+					break;
+				}
+			}
+
+			if (block == nullptr) { //every block of this kind is full, add one
+				std::unique_ptr<MemoryBlock> fresh(new MemoryBlock());
+				fresh->size = blockSize(memoryType);
+				fresh->memory = allocateMemory(fresh->size, memoryType);
+				fresh->mapped = static_cast<unsigned char *>(mapIfHostVisible(fresh->memory, memoryType));
+				fresh->memoryType = memoryType;
+				fresh->linear = linear;
+				fresh->freeRanges[0] = fresh->size;
+
+				statistics.blockCount++;
+				statistics.bytesReserved += fresh->size;
+
+				block = fresh.get();
+				blocks.push_back(std::move(fresh));
+
+				if (!suballocate(*block, requirements, offset))
+					throw std::runtime_error("Allocation does not fit in a fresh memory block.");
+			}
+
+			allocation.memory = block->memory;
+			allocation.offset = offset;
+			allocation.block = block;
+			allocation.mapped = block->mapped != nullptr ? block->mapped + offset : nullptr;
+		}
+
+		statistics.allocationCount++;
+		statistics.bytesUsed += requirements.size;
+		return allocation;
+	}
+
+	void free(MemoryAllocation &allocation) {
+		if (allocation.memory == VK_NULL_HANDLE)
+			return;
+
+		if (allocation.block == nullptr) {
+			vkFreeMemory(device, allocation.memory, nullptr); //implicitly unmaps
+			statistics.dedicatedCount--;
+			statistics.bytesReserved -= allocation.size;
+		} else {
+			MemoryBlock &block = *allocation.block;
+			releaseRange(block, allocation.offset, allocation.size);
+			block.used -= allocation.size;
+
+			if (block.used == 0)
+				releaseIfSpare(block);
+		}
+
+		statistics.allocationCount--;
+		statistics.bytesUsed -= allocation.size;
+		allocation = MemoryAllocation();
+	}
+
+	void destroy() { //every allocation should have been freed by now
+		if (statistics.allocationCount != 0)
+			std::cerr << "Device memory allocator destroyed with " << statistics.allocationCount << " live allocations." << std::endl;
+
+		for (auto &block : blocks)
+			vkFreeMemory(device, block->memory, nullptr);
+
+		blocks.clear();
+		statistics = MemoryStats();
+	}
+
+	const MemoryStats &stats() const { return statistics; }
+
+private:
+	VkDevice device = VK_NULL_HANDLE;
+	VkPhysicalDeviceMemoryProperties memProps = {};
+	uint32_t maxAllocations = 4096; //spec minimum
+	std::vector<std::unique_ptr<MemoryBlock>> blocks;
+	MemoryStats statistics;
+
+	VkDeviceSize blockSize(uint32_t memoryType) const { //small heaps (e.g. 256MB of host visible vram) get smaller blocks so one block can't eat the heap
+		VkDeviceSize heapSize = memProps.memoryHeaps[memProps.memoryTypes[memoryType].heapIndex].size;
+		return std::min(DEVICE_MEMORY_BLOCK_SIZE, heapSize / 8);
+	}
+
+	VkDeviceMemory allocateMemory(VkDeviceSize size, uint32_t memoryType) {
+		if (statistics.blockCount + statistics.dedicatedCount >= maxAllocations)
+			throw std::runtime_error("Out of device memory allocations.");
+
+		VkMemoryAllocateInfo allocInfo = {};
+		allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+		allocInfo.allocationSize = size;
+		allocInfo.memoryTypeIndex = memoryType;
+
+		VkDeviceMemory memory;
+		if (vkAllocateMemory(device, &allocInfo, nullptr, &memory) != VK_SUCCESS)
+			throw std::runtime_error("Failed to allocate device memory.");
+
+		return memory;
+	}
+
+	void *mapIfHostVisible(VkDeviceMemory memory, uint32_t memoryType) {
+		if (!(memProps.memoryTypes[memoryType].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT))
+			return nullptr;
+
+		void *data;
+		if (vkMapMemory(device, memory, 0, VK_WHOLE_SIZE, 0, &data) != VK_SUCCESS) //memory can only be mapped once, so map it all for good
+			throw std::runtime_error("Failed to map device memory.");
+
+		return data;
+	}
+
+	static bool suballocate(MemoryBlock &block, const VkMemoryRequirements &requirements, VkDeviceSize &offset) { //first fit
+		for (auto range = block.freeRanges.begin(); range != block.freeRanges.end(); ++range) {
+			VkDeviceSize rangeStart = range->first;
+			VkDeviceSize rangeEnd = range->first + range->second;
+			VkDeviceSize start = (rangeStart + requirements.alignment - 1) / requirements.alignment * requirements.alignment;
+
+			if (start + requirements.size > rangeEnd)
+				continue;
+
+			block.freeRanges.erase(range);
+			if (start > rangeStart) //alignment padding stays free
+				block.freeRanges[rangeStart] = start - rangeStart;
+			if (start + requirements.size < rangeEnd)
+				block.freeRanges[start + requirements.size] = rangeEnd - start - requirements.size;
+
+			block.used += requirements.size;
+			offset = start;
+			return true;
+		}
+
+		return false;
+	}
+
+	static void releaseRange(MemoryBlock &block, VkDeviceSize offset, VkDeviceSize size) {
+		VkDeviceSize start = offset, end = offset + size;
+		auto next = block.freeRanges.lower_bound(offset);
+
+		if (next != block.freeRanges.end() && next->first == end) { //merge with the range after
+			end += next->second;
+			next = block.freeRanges.erase(next);
+		}
+
+		if (next != block.freeRanges.begin()) { //and the one before
+			auto prev = std::prev(next);
+			if (prev->first + prev->second == start) {
+				start = prev->first;
+				block.freeRanges.erase(prev);
+			}
+		}
+
+		block.freeRanges[start] = end - start;
+	}
+
+	void releaseIfSpare(MemoryBlock &block) { //keep one empty block per kind around so a resource freed and recreated every frame doesn't churn vkAllocateMemory
+		for (const auto &other : blocks)
+			if (other.get() != &block && other->memoryType == block.memoryType && other->linear == block.linear && other->used == 0) {
+				vkFreeMemory(device, block.memory, nullptr);
+				statistics.blockCount--;
+				statistics.bytesReserved -= block.size;
+
+				blocks.erase(std::find_if(blocks.begin(), blocks.end(), [&block](const std::unique_ptr<MemoryBlock> &b) { return b.get() == &block; }));
+				return;
+			}
+	}
+};
+
+template<typename T, size_t Capacity>
+class SpscQueue { //single producer single consumer ring - neither side ever takes a lock or waits on the other
+public:
+	bool push(const T &item) { //producer only, false when full
+		size_t head = headIndex.load(std::memory_order_relaxed);
+		size_t next = (head + 1) % Capacity;
+		if (next == tailIndex.load(std::memory_order_acquire))
+			return false;
+
+		items[head] = item;
+		headIndex.store(next, std::memory_order_release); //publish the item after it's written
+		return true;
+	}
+
+	bool pop(T &item) { //consumer only, false when empty
+		size_t tail = tailIndex.load(std::memory_order_relaxed);
+		if (tail == headIndex.load(std::memory_order_acquire))
+			return false;
+
+		item = items[tail];
+		tailIndex.store((tail + 1) % Capacity, std::memory_order_release); //hand the slot back once it's read
+		return true;
+	}
+
+private:
+	std::array<T, Capacity> items;
+	alignas(64) std::atomic<size_t> headIndex{ 0 }; //next slot the producer writes, on its own cache line so the two threads don't fight over it
+	alignas(64) std::atomic<size_t> tailIndex{ 0 }; //next slot the consumer reads
+};
+
+struct WindowEvent { //posted by the glfw thread, handled by the render thread at the top of each frame
+	enum Type { Resize, Close, CycleLighting } type;
+	int width;
+	int height;
+};
+
+const size_t WINDOW_EVENT_QUEUE_SIZE = 256; //a resize drag posts one per os event, the render thread drains them every frame
+
+struct PipelineCachePrefix { //ours, written ahead of the driver's blob so a driver update throws the cache away
+	uint32_t magic;
+	uint32_t driverVersion;
+	uint64_t dataSize;
+};
+
+const uint32_t PIPELINE_CACHE_MAGIC = 0x43504254; //"TBPC"
+
+struct PipelineCacheHeader { //VK_PIPELINE_CACHE_HEADER_VERSION_ONE layout the driver's blob starts with
+	uint32_t headerSize;
+	uint32_t headerVersion;
+	uint32_t vendorID;
+	uint32_t deviceID;
+	uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+};
+
+struct PipelineVariant { //everything that makes one of our pipelines different from another, the layout is always pipelineLayout
+	std::string vertPath;
+	std::string fragPath;
+	VkRenderPass pass;
+	std::vector<uint32_t> specialization; //fragment stage constant_id i gets word i, empty for none
+
+	bool operator<(const PipelineVariant &other) const {
+		return std::tie(vertPath, fragPath, pass, specialization) < std::tie(other.vertPath, other.fragPath, other.pass, other.specialization);
+	}
+};
+
+struct AsyncPipeline { //a variant compiling on its own thread against the shared pipeline cache
+	std::shared_future<VkPipeline> future;
+	VkPipeline pipeline = VK_NULL_HANDLE; //set once the future has been collected
+};
+
+struct PipelineReload { //a variant rebuilding against freshly compiled shaders, the old pipeline stays in use until it's done
+	PipelineVariant variant;
+	bool fallback; //replaces graphicsPipeline rather than a pipelineVariants entry
+	std::shared_future<VkPipeline> future;
+};
+
+struct DrawCommand { //one indexed draw out of the shared vertex and index buffers
+	uint32_t firstIndex;
+	uint32_t indexCount;
+	glm::mat4 transform; //model matrix, pushed as DrawPushConstants
+};
+
+struct DrawPushConstants { //push_constant block in shader.vert, vertex stage only - 128 bytes is all a device has to offer
+	glm::mat4 model;
+	glm::mat4 normalModel; //inverse-transpose of model, keeps normals straight under non-uniform scale
+};
+
+struct RecordWorker { //a recording thread's own pool, command pools can't be touched from two threads at once
+	VkCommandPool pool = VK_NULL_HANDLE;
+};
+
+struct RecordSegment { //run of drawList recorded into its own secondaries, only re-recorded when something in it changes
+	size_t firstDraw;
+	size_t drawCount;
+	uint32_t worker; //whose pool the secondaries come from and who records them
+	uint64_t version = 1; //bumped by markDrawsDirty
+	std::vector<VkCommandBuffer> secondaries; //one per swapchain image, they bake in its framebuffer and ubo slot
+	std::vector<uint64_t> recorded; //version each image's secondary was last recorded at, 0 for never
+};
+
+const uint32_t MAX_RECORD_WORKERS = 8; //RECORD_THREADS overrides the default of one per core up to this
+const size_t RECORD_SEGMENT_DRAWS = 256; //most draws a segment holds, smaller segments mean less to re-record per change
+
+typedef uint64_t UploadToken; //serial of the submission carrying an upload - it's complete once completedUpload reaches it
+
+struct StagingSubmission { //upload command buffer in flight, its staging ring bytes come back when the fence signals
+	VkFence fence = VK_NULL_HANDLE;
+	VkCommandBuffer commandBuffer;
+	VkFence transferFence = VK_NULL_HANDLE; //set when the bytes go over the transfer queue first - graphics work waits for it before being submitted
+	VkSemaphore transferDone = VK_NULL_HANDLE;
+	VkCommandBuffer transferCommands = VK_NULL_HANDLE; //ring to landing buffer copies and the ownership release, from transferCommandPool
+	VkCommandBuffer acquireCommands = VK_NULL_HANDLE; //ownership acquire, runs ahead of commandBuffer
+	VkDeviceSize ringEnd; //stagingHead at submit, everything before it is free once this retires
+	UploadToken token;
+};
+
+struct FeedbackReadback { //host visible copy of one frame slot's feedback image, only read once the slot's fence has been waited on
+	VkBuffer buffer = VK_NULL_HANDLE;
+	MemoryAllocation memory;
+	uint32_t *mapped = nullptr; //persistent mapping of buffer
+	bool written = false; //the slot's last submitted frame copied into it and nobody has read it since
+};
+
+struct DetailImage { //a texture's levels from baseMip down to its tail, re-created whenever residency changes so its memory follows what's on screen
+	VkImage image = VK_NULL_HANDLE;
+	MemoryAllocation memory;
+	VkImageView view = VK_NULL_HANDLE;
+	uint32_t baseMip = 0; //texture mip held in level 0
+	UploadToken filled = 0; //submission that copies its levels in
+};
+
+struct TextureDetail { //per packed texture - the descriptor set samples bound, which lags newest until newest's upload is on the graphics queue
+	DetailImage newest; //what the next residency change copies from
+	DetailImage bound;
+};
+
+struct GpuTimepoint { //reached once every frame up to frame and every upload up to upload have finished on the GPU
+	uint64_t frame;
+	UploadToken upload;
+};
+
+struct PendingDestroy { //handle the GPU may still be using, destroyed by collectDeletions once its timepoint is reached
+	GpuTimepoint after;
+	std::function<void()> destroy;
+};
+
+struct ScheduledUpload { //loaded mip or page competing for this frame's upload budget
+	float priority; //2 if it's wanted on screen this frame, plus up to 1 for how much it matters there
+	VkDeviceSize bytes;
+	bool page; //index is into vtReady, otherwise mipReady
+	size_t index;
+};
+
+struct UploadTally { //what an upload pass actually recorded
+	VkDeviceSize bytes = 0;
+	uint32_t copies = 0;
+};
+
+struct UploadMetrics { //streaming upload counters, reported and reset with the FPS
+	size_t queueDepth = 0; //loaded and still waiting for budget after the last frame
+	VkDeviceSize bytes = 0;
+	VkDeviceSize peakFrameBytes = 0;
+	uint32_t copies = 0;
+	uint32_t frames = 0;
+};
+
 struct QueueFamilyIndices { //struct to hold current device indexes for queue families being used
 	int graphicsFamily = -1; //graphics family index - draw related operations - implies memory transfer operations support
 	int presentFamily = -1;  //present family index - operations related to presenting images to swapchain/framebuffers - ideally the same as the graphics family
+	int transferFamily = -1; //family without graphics for streaming uploads, -1 when everything has to share the graphics queue
 
 	bool isComplete() { //return true if all needed queues have been found
 		return graphicsFamily >= 0 && presentFamily >= 0;
@@ -153,6 +707,67 @@ static std::vector<char> readFile(const std::string &filename) {
 	return buffer;
 }
 
+static std::string readBytes(const std::string &filename) { //readFile without the logging or throwing, empty if it's missing
+	std::ifstream file(filename, std::ios::binary);
+	return std::string((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+}
+
+static SourceStamp sourceStamp(const std::string &filename) { //zeroes if it's missing
+	struct stat info;
+	if (stat(filename.c_str(), &info) != 0)
+		return { 0, 0 };
+	return { static_cast<uint64_t>(info.st_size), static_cast<int64_t>(info.st_mtime) };
+}
+
+static uint64_t hashBytes(const std::string &bytes) { //FNV-1a, keys the compiled shader cache on its source so an unchanged source is never compiled twice
+	uint64_t hash = 14695981039346656037ull;
+	for (char c : bytes) {
+		hash ^= static_cast<unsigned char>(c);
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+struct ShaderSource { //spir-v a pipeline loads and the glsl it's built from
+	std::string spvPath;
+	std::string sourcePath;
+	shaderc_shader_kind kind;
+};
+
+const ShaderSource SHADER_SOURCES[] = { //what Shaders/compile.bat builds
+	{ "shaders/vert.spv", "shaders/shader.vert", shaderc_glsl_vertex_shader },
+	{ "shaders/frag.spv", "shaders/shader.frag", shaderc_glsl_fragment_shader },
+	{ "shaders/feedback.spv", "shaders/feedback.frag", shaderc_glsl_fragment_shader }
+};
+
+const uint32_t SHADER_CACHE_MAGIC = 0x43565053; //"SPVC"
+const uint32_t SPIRV_MAGIC = 0x07230203;
+
+struct ShaderCacheHeader { //start of a <spv path>.cache file, the hot reload compile of a source - one per source, replaced when the source changes
+	uint32_t magic;
+	uint32_t wordCount; //spir-v words that follow, a short file doesn't match
+	uint64_t sourceHash; //hashBytes of the glsl it was compiled from
+};
+
+struct EmbeddedShader {
+	const char *name; //the path a pipeline asks for, the .spv on disk development builds can override it with
+	const uint32_t *code;
+	size_t codeSize; //bytes
+};
+
+const EmbeddedShader EMBEDDED_SHADERS[] = {
+	{ "shaders/vert.spv", vert_spv, sizeof(vert_spv) },
+	{ "shaders/frag.spv", frag_spv, sizeof(frag_spv) },
+	{ "shaders/feedback.spv", feedback_spv, sizeof(feedback_spv) }
+};
+
+static const EmbeddedShader *findEmbeddedShader(const std::string &name) {
+	for (const auto &shader : EMBEDDED_SHADERS)
+		if (name == shader.name)
+			return &shader;
+	return nullptr;
+}
+
 const std::vector<const char*> validationLayers = {
 
 		"VK_LAYER_LUNARG_standard_validation" //use the standard lunarG validation layers
@@ -174,10 +789,16 @@ class TriangleBasicsApp {
 
 public:
 	void run() {
-		initWindow(); //call glfw setup functions to open window
-		initVulkan(); //something like 900 lines of data entry, a function call every so often to mix things up
-		mainLoop(); //program only does 4 things right now, occasionally blow stuff up to reset it
-		cleanup(); //blow everything up in the right order
+		initWindow(); //call glfw setup functions to open window - glfw stays on this thread and only handles window events from here on
+		renderThread = std::thread(&TriangleBasicsApp::renderMain, this); //vulkan lives entirely on the render thread
+		pollWindowEvents();
+		renderThread.join();
+
+		glfwDestroyWindow(window);
+		glfwTerminate();
+
+		if (renderError) //init or a frame threw on the render thread, report it like it happened here
+			std::rethrow_exception(renderError);
 	}
 
 private:
@@ -191,14 +812,36 @@ private:
 	};
 
 	GLFWwindow *window; //created by glfw with vulkan instead of OpenGL - platform agnostic code
+	std::thread renderThread; //owns the device, the frame loop and swapchain recreation
+	SpscQueue<WindowEvent, WINDOW_EVENT_QUEUE_SIZE> windowEvents; //main thread to render thread
+	std::atomic<bool> renderRunning{ true }; //cleared by the render thread on its way out so the event loop stops
+	std::exception_ptr renderError;
+	int windowWidth = WIDTH; //render thread's copy of the window size, only changed by Resize events
+	int windowHeight = HEIGHT;
+	bool closeRequested = false; //render thread only
 
 	VkInstance instance; //Vulkan instance - explicitly created - destroy last
 	VkPhysicalDevice physicalDevice = VK_NULL_HANDLE; //physical device to use - retrieved from instance - implicitly destroyed shares lifecycle with instance
+	bool anisotropySupported = false; //optional since device scoring allows devices without it
 
 	VkDevice device; //logical device created from the physical device - explicitly created from physical device - destroy only after everything created from it
+	VkPipelineCache pipelineCache = VK_NULL_HANDLE; //every pipeline goes through it, loaded at startup and saved at shutdown
+	std::map<PipelineVariant, AsyncPipeline> pipelineVariants; //everything compiled or compiling asynchronously, owns the pipelines
+	std::vector<std::shared_future<VkPipeline>> retiredCompiles; //variants dropped while still compiling, destroyed once they finish
+	std::vector<PipelineReload> reloadingPipelines; //render thread only
+
+	std::thread shaderWatcher; //hot reload, compiles changed shader sources
+	std::mutex shaderMutex; //guards everything below
+	std::condition_variable shaderWake; //only to stop it
+	bool shaderWatcherStop = false;
+	std::map<std::string, std::vector<uint32_t>> shaderBinaries; //spv path a pipeline asks for -> the freshest compile of its source
+	std::vector<std::string> shadersChanged; //spv paths recompiled since the render thread last looked
+
+	DeviceMemoryAllocator memoryAllocator; //every buffer and image gets its memory from here - destroy after all of them
 
 	VkQueue graphicsQueue; //the graphics queue - explicitly created from the device - destroy before device
 	VkQueue presentQueue; //the present queue - explicitly created from the device - destroy before device
+	VkQueue transferQueue = VK_NULL_HANDLE; //streaming uploads run here when the device has a separate transfer family
 
 	VkDebugReportCallbackEXT callback; //debug message callback function to output to console - explicitly created from instance - destroy before instance
 
@@ -214,7 +857,11 @@ private:
 	VkRenderPass renderPass;
 	VkDescriptorSetLayout desSetLayout;
 	VkPipelineLayout pipelineLayout;
-	VkPipeline graphicsPipeline;
+	VkPipeline graphicsPipeline; //LIGHTING_UNIFORM, built up front - the fallback while a folded lighting variant compiles
+	VkPipeline scenePipeline = VK_NULL_HANDLE; //what the draw segments were recorded with
+	LightingParams sceneLighting = DEFAULT_LIGHTING;
+	size_t lightingPreset = 0; //LIGHTING_PRESETS entry sceneLighting came from
+	bool foldLighting = true; //compile the current lighting into its own variant, LIGHTING=uniform turns it off
 
 	std::vector<VkFramebuffer> swapChainFramebuffers;
 
@@ -222,32 +869,157 @@ private:
 	std::vector<uint32_t> vIndices;
 
 	VkBuffer vertexBuffer;
-	VkDeviceMemory vertexBufferMemory;
+	MemoryAllocation vertexBufferMemory;
 
 	VkBuffer indexBuffer;
-	VkDeviceMemory indexBufferMemory;
-
-	VkBuffer uniformBuffer;
-	VkDeviceMemory uniformBufferMemory;
-
-	VkImage texImage; //image object to hold texture texels - explicitly created on the device - destroy before the device
-	VkDeviceMemory texImageMem; //device memory to hold our image object - explicitly created on the device - free after the destruction of the related buffer
-	VkImageView texImgView; //image view for our texture - created from texture image - delete before the image
+	MemoryAllocation indexBufferMemory;
+
+	VkBuffer uniformBuffer; //one UniformBufferObject slot per swapchain image, picked with a dynamic offset
+	MemoryAllocation uniformBufferMemory; //host visible, stays mapped
+	VkDeviceSize uniformStride = 0; //slot size rounded up to minUniformBufferOffsetAlignment
+	uint32_t uniformSlots = 0;
+	UniformBufferObject frameUbo = {}; //built by updateUniformBuffer, stored into the acquired image's slot by drawFrame
+
+	VkImage texImage; //layered image holding every texture's tail, packed by createTextureImage - explicitly created on the device - destroy before the device
+	MemoryAllocation texImageMem; //device memory to hold our image object - explicitly created on the device - free after the destruction of the related buffer
+	VkImageView texImgView; //2d array view for our textures - created from texture image - delete before the image
+	uint32_t texLayerCount = 1; //number of layers in the texture array
+	uint32_t texLayerWidth = 1; //size of every layer
+	uint32_t texLayerHeight = 1;
+	uint32_t texMipLevels = 1; //full chain for the layer size, level 0 holds every texture's tailMip
+
+	std::vector<PackedTexture> packedTextures; //textures in the array and their mip residency - fixed once the loader thread starts, apart from the residency fields
+	std::vector<TextureDetail> textureDetails; //per packed texture, render thread only
+	bool detailStreaming = false; //device can index the detail images by material, otherwise whole chains go in the atlas
+	VkImage detailFallbackImage; //1x1, what materials without a detail image point at
+	MemoryAllocation detailFallbackMem;
+	VkImageView detailFallbackView;
+	VkSampler detailSampler; //repeats, no lod clamp - a detail image only ever holds resident levels
+	std::vector<MaterialBounds> materialBounds; //per material, filled by loadModel
+	glm::mat4 frameModelView; //this frame's matrices from updateUniformBuffer, for screen size estimates
+	glm::mat4 frameProjection;
+	VkDeviceSize textureBudget = DEFAULT_TEXTURE_BUDGET;
+	VkDeviceSize streamedBytes = 0; //detail image bytes above the tails
+	uint64_t streamFrame = 0;
+
+	std::thread mipLoader; //reads requested mip levels off disk
+	std::mutex mipMutex; //guards everything below
+	std::condition_variable mipWake;
+	std::deque<uint32_t> mipRequests;
+	std::vector<LoadedMip> mipLoaded;
+	std::vector<LoadedMip> mipReady; //taken from mipLoaded, waiting for upload budget - main thread only
+	std::unordered_set<uint32_t> mipPending; //requested, being read or loaded
+	bool mipStopLoader = false;
+
+	std::vector<std::string> textureFiles; //textures used by the model, index matches the material table
+	std::vector<Material> materials; //per material layer and uv rect, uploaded to materialBuffer
+
+	VkBuffer materialBuffer; //uniform buffer holding the material table - explicitly created on the device - destroy before the device
+	MemoryAllocation materialBufferMemory; //device memory for the material table - free after the destruction of the buffer
+
+	std::vector<VirtualTexture> virtualTextures; //streamed textures, index matches Material::virtualTexture - fixed once the loader thread starts
+	VkBuffer vtInfoBuffer; //uniform buffer of VirtualTextureInfo - explicitly created on the device - destroy before the device
+	MemoryAllocation vtInfoBufferMemory;
+	VkImage vtCacheImage; //physical page cache, pages live in VT_CACHE_PAGES x VT_CACHE_PAGES slots - 1x1 when nothing is virtual
+	MemoryAllocation vtCacheImageMem;
+	VkImageView vtCacheImgView;
+	VkSampler vtCacheSampler; //linear clamp, page borders cover the filter footprint
+	VkImage vtIndirectionImage; //R32_UINT, one layer per virtual texture and one mip per page mip - entry is cache slot x | y << 8 | resident mip << 16
+	MemoryAllocation vtIndirectionImageMem;
+	VkImageView vtIndirectionImgView;
+	VkSampler vtIndirectionSampler; //nearest, the shader only texelFetches it
+	uint32_t vtIndirectionSize = 1; //mip 0 side, power of two so every mip's page grid fits the matching indirection mip
+	uint32_t vtIndirectionMips = 1;
+	std::vector<uint32_t> vtSlotKey; //page held by each cache slot, VT_INVALID_KEY when empty
+	std::vector<uint64_t> vtSlotLastUsed; //vtFrame the slot's page was last asked for
+	std::vector<bool> vtSlotPinned; //top mips never get evicted so every lookup resolves to something
+	std::unordered_map<uint32_t, uint32_t> vtResident; //page key -> cache slot
+	uint64_t vtFrame = 0;
+
+	std::thread vtLoader; //reads requested pages off disk so the render loop never waits on file io
+	std::mutex vtMutex; //guards everything below
+	std::condition_variable vtWake;
+	std::deque<uint32_t> vtRequests; //pages to read, coarsest first
+	std::vector<LoadedPage> vtLoaded; //pages read but not yet uploaded
+	std::unordered_set<uint32_t> vtPending; //requested, being read or loaded - keeps pages from being asked for twice
+	bool vtStopLoader = false;
+	std::vector<LoadedPage> vtReady; //taken from vtLoaded, waiting for upload budget - main thread only
+	std::unordered_set<uint32_t> vtWanted; //pages the last feedback pass found missing
+
+	VkDeviceSize uploadBytesPerFrame = DEFAULT_UPLOAD_BYTES_PER_FRAME;
+	uint32_t uploadCopiesPerFrame = DEFAULT_UPLOAD_COPIES_PER_FRAME;
+	UploadMetrics uploadMetrics;
+
+	VkRenderPass feedbackRenderPass; //page request pass - only created when there are virtual textures
+	PipelineVariant feedbackVariant; //compiled in the background, the pass is skipped until it's ready
+	VkExtent2D feedbackExtent = {};
+	VkImage feedbackImage; //R32_UINT page key per pixel
+	MemoryAllocation feedbackImageMem;
+	VkImageView feedbackImgView;
+	VkImage feedbackDepthImage;
+	MemoryAllocation feedbackDepthImageMem;
+	VkImageView feedbackDepthImgView;
+	VkFramebuffer feedbackFramebuffer;
+	std::array<FeedbackReadback, MAX_FRAMES_IN_FLIGHT> feedbackReadbacks; //per frame slot, created before framesInFlight is decided so sized for the most there can be
 
 	VkImage depthImage; //image object to hold depth attachment image one needed per running draw op- explicitly created on the device - destroy before the device
-	VkDeviceMemory depthImageMem; //device memory to hold our depth image object - explicitly created on the device - free after the destruction of the related buffer
+	MemoryAllocation depthImageMem; //device memory to hold our depth image object - explicitly created on the device - free after the destruction of the related buffer
 	VkImageView depthImgView; //image view for our depth - created from texture image - delete before the image
 
 	VkSampler texSampler; //sampler to take our texel data and turn it into proper fragment data - explicitly created on the device - destroy before the device
 
+	VkBuffer stagingBuffer; //long lived transfer source for uploads - explicitly created on the device - destroy before the device
+	MemoryAllocation stagingBufferMemory; //host visible memory backing the staging buffer - mapped once at creation - free after the destruction of the buffer
+	unsigned char *stagingMapped = nullptr; //persistent mapping of the staging memory
+	VkDeviceSize stagingHead = 0; //bytes ever handed out of the ring - offset is this modulo STAGING_BUFFER_SIZE
+	VkDeviceSize stagingTail = 0; //bytes ever given back, head - tail is what copies in flight or being recorded still read
+	std::deque<StagingSubmission> uploadsInFlight; //oldest first, the queue finishes them in this order
+	std::vector<std::pair<VkBuffer, MemoryAllocation>> pendingTempBuffers; //temp buffers recorded since the last submit
+	std::vector<VkFence> freeUploadFences; //signalled fences reset and ready for reuse
+	UploadToken uploadSerial = 0; //token of the last submission
+	UploadToken completedUpload = 0; //token of the last retired submission
+	std::deque<StagingSubmission> uploadsPending; //waiting on their transfer before the graphics side goes on the queue, kept in order
+	std::vector<VkSemaphore> freeUploadSemaphores;
+	VkDeviceSize stagingSubmitted = 0; //stagingHead at the last submit, where the next transfer starts copying
+	VkBuffer landingBuffer = VK_NULL_HANDLE; //device local mirror of the staging ring the transfer queue copies into
+	MemoryAllocation landingBufferMemory;
+	bool streamingRecording = false; //set between beginStreamingCommands and submitUploads
+	bool unifiedMemory = false; //integrated, software or resizable BAR device - buffers skip staging and the ring itself is device local
+	VkCommandBuffer uploadBatch = VK_NULL_HANDLE; //load phase copies and barriers collect here until something needs them - submitted as one
+	VkDeviceSize stagingAlignment = 16; //offset alignment for copies out of the staging buffer
+
 	VkCommandPool commandPool;
+	VkCommandPool transferCommandPool = VK_NULL_HANDLE; //command buffers for transferQueue
 	VkDescriptorPool desPool;
 	VkDescriptorSet desSet;
 
-	std::vector<VkCommandBuffer> commandBuffers;
-
-	VkSemaphore imageAvailableSemaphore;
-	VkSemaphore renderFinishedSemaphore;
+	std::vector<VkCommandBuffer> commandBuffers; //one primary per frame slot, recorded every frame around the cached secondaries
+
+	std::vector<DrawCommand> drawList; //one draw per obj shape, split into segments between the record workers
+	std::vector<RecordSegment> recordSegments;
+	uint32_t segmentsRecorded = 0; //since the last fps report
+	std::vector<RecordWorker> recordWorkers; //worker 0 runs on the thread asking for the recording
+	std::vector<std::thread> recordThreads; //workers 1 and up
+	std::mutex recordMutex; //guards everything below
+	std::condition_variable recordWake; //a new job or stop
+	std::condition_variable recordIdle; //the last worker finished the job
+	std::function<void(uint32_t)> recordJob; //called with the worker index
+	uint64_t recordGeneration = 0; //bumped per job so a worker never runs one twice
+	uint32_t recordBusy = 0; //workers still running the current job
+	bool recordStop = false;
+	std::exception_ptr recordError; //first exception a worker hit, rethrown by parallelRecord
+
+	uint32_t framesInFlight = DEFAULT_FRAMES_IN_FLIGHT;
+	uint32_t currentFrame = 0; //frame slot drawFrame uses next
+	std::vector<VkSemaphore> imageAvailableSemaphores; //per frame slot
+	std::vector<VkSemaphore> renderFinishedSemaphores;
+	std::vector<VkFence> inFlightFences; //signalled when the slot's last frame has finished on the GPU
+	std::vector<VkFence> imagesInFlight; //per swapchain image, the fence of the frame last drawn to it - its ubo slot and command buffer are busy until then
+	std::vector<uint64_t> slotFrames; //frame number last submitted with each slot's fence
+	uint64_t frameNumber = 0; //frames submitted so far
+	uint64_t completedFrame = 0; //every frame up to this one has finished on the GPU
+	bool swapchainStale = false; //resized or out of date, recreated once at the top of the next frame however many events came in
+	std::deque<PendingDestroy> deletionQueue; //roughly oldest first, keys from both timelines so it's scanned rather than popped
 
 	QueueFamilyIndices indicies;
 
@@ -262,17 +1034,79 @@ private:
 
 		window = glfwCreateWindow(WIDTH, HEIGHT, "Vulkan", nullptr, nullptr);
 
+		glfwGetWindowSize(window, &windowWidth, &windowHeight); //before the render thread starts, after that it only hears about the size through events
+
 		glfwSetWindowUserPointer(window, this);
 		glfwSetWindowSizeCallback(window, TriangleBasicsApp::onWindowResize);
+		glfwSetKeyCallback(window, TriangleBasicsApp::onKey);
 
 	}
 
 	static void onWindowResize(GLFWwindow *window, int width, int height) {
-		if (width == 0 || height == 0) return;
 		TriangleBasicsApp *app = reinterpret_cast<TriangleBasicsApp *>(glfwGetWindowUserPointer(window));
-		app->recreateSwapchain();
+		app->postWindowEvent({ WindowEvent::Resize, width, height }); //zero sizes too, the render thread pauses while minimised
+	}
+
+	static void onKey(GLFWwindow *window, int key, int scancode, int action, int mods) {
+		TriangleBasicsApp *app = reinterpret_cast<TriangleBasicsApp *>(glfwGetWindowUserPointer(window));
+		if (key == GLFW_KEY_L && action == GLFW_PRESS)
+			app->postWindowEvent({ WindowEvent::CycleLighting, 0, 0 });
+	}
+
+	void postWindowEvent(const WindowEvent &event) {
+		while (!windowEvents.push(event) && renderRunning) //only full if the render thread is stuck in a long frame, let it catch up
+			std::this_thread::yield();
+	}
+
+	void pollWindowEvents() { //main thread loop, sleeps in the os until there's something to forward
+		bool closePosted = false;
+
+		while (renderRunning) {
+			glfwWaitEvents(); //the render thread posts an empty event when it exits so this returns
+
+			if (!closePosted && glfwWindowShouldClose(window)) {
+				postWindowEvent({ WindowEvent::Close, 0, 0 });
+				closePosted = true;
+			}
+		}
+	}
+
+	void renderMain() {
+		try {
+			initVulkan(); //something like 900 lines of data entry, a function call every so often to mix things up
+			mainLoop(); //program only does 4 things right now, occasionally blow stuff up to reset it
+			cleanup(); //blow everything up in the right order
+		} catch (...) {
+			renderError = std::current_exception();
+		}
+
+		renderRunning = false;
+		glfwPostEmptyEvent(); //wake the main thread out of glfwWaitEvents
+	}
 
+	void processWindowEvents() { //render thread, drains everything posted since the last frame
+		WindowEvent event;
+		while (windowEvents.pop(event)) {
+			switch (event.type) {
+			case WindowEvent::Resize:
+				windowWidth = event.width;
+				windowHeight = event.height;
+				swapchainStale = true;
+				break;
+			case WindowEvent::Close:
+				closeRequested = true;
+				break;
+			case WindowEvent::CycleLighting: //the ubo has it this frame, the folded variant once it compiles
+				lightingPreset = (lightingPreset + 1) % (sizeof(LIGHTING_PRESETS) / sizeof(LIGHTING_PRESETS[0]));
+				setSceneLighting(LIGHTING_PRESETS[lightingPreset]);
+				break;
+			}
+		}
 
+		if (swapchainStale && !closeRequested && windowWidth > 0 && windowHeight > 0) { //a whole drag's worth of sizes becomes one recreate
+			swapchainStale = false;
+			recreateSwapchain();
+		}
 	}
 
 
@@ -285,35 +1119,56 @@ private:
 
 		pickPhysicalDevice();
 		createLogicalDevice();
+		memoryAllocator.init(device, physicalDevice);
+		detectUnifiedMemory();
 		createSwapChain();
 		createImageViews();
 		createRenderPass();
 		createDescriptorSetLayout();
+		createPipelineCache();
 		createGraphicsPipeline();
 
 		createCommandPool();
+		createStagingBuffer();
 
 		createDepthResources();
 
 		createFrameBuffer();
 
-		createTextureImage("Ancient Ugandan.png"); //load texture image into device memory
+		loadModel("AncientUgandan.obj"); //load first, the model's materials decide which textures get packed
+
+		createTextureImage(textureFiles); //pack every texture into one image array in device memory
 		createTextureImageView(); //create a view for our texture
 		createTexureSampler();
-
-		loadModel("AncientUgandan.obj");
+		createVirtualTextureResources(); //page cache, indirection and the loader thread for textures too big to upload whole
 
 		createVertexBuffer();
 		
 		createIndexBuffer();
+
+		createMaterialBuffer();
 		
 		createUniformBuffer();
 		createDescriptorPool();
 		createDescriptorSet();
 
+		createFeedbackPass();
+		createFeedbackTargets();
+		prewarmPipelines(declaredPipelineVariants()); //compiles while the rest of init and the first frames run
+		startShaderWatcher();
+
+		createSyncObjects(); //decides framesInFlight, the primaries are per frame slot
+
+		createRecordWorkers();
 		createCommandBuffers();
 
-		createSemaphores();
+		flushUploadBatch(); //end of the load phase, one submit for every transition and copy recorded above
+
+#ifndef NDEBUG
+		const MemoryStats &memStats = memoryAllocator.stats();
+		std::cout << "Device memory: " << memStats.allocationCount << " allocations in " << memStats.blockCount << " blocks and " << memStats.dedicatedCount << " dedicated, "
+			<< memStats.bytesUsed / (1024 * 1024) << "MB used of " << memStats.bytesReserved / (1024 * 1024) << "MB reserved." << std::endl;
+#endif
 	}
 
 	void createInstance() {
@@ -455,29 +1310,91 @@ private:
 		std::vector<VkPhysicalDevice> devices(deviceCount);
 		vkEnumeratePhysicalDevices(instance, &deviceCount, devices.data());
 
-		for (const auto &device : devices) {
-			if (isDeviceSuitable(device)) {
-				physicalDevice = device;
-				break;
+		const char *requested = std::getenv("VULKAN_DEVICE"); //index or part of the device name, skips scoring if it names a usable device
+		if (requested != nullptr && *requested == '\0') //set but empty would match every name
+			requested = nullptr;
+
+		bool byIndex = requested != nullptr && std::string(requested).find_first_not_of("0123456789") == std::string::npos; //"1" picks device 1, not every name with a 1 in it
+		uint32_t namedCount = 0; //usable devices the override matches, the first one wins
+		int64_t bestScore = -1;
+
+		for (uint32_t i = 0; i < deviceCount; i++) {
+			VkPhysicalDeviceProperties deviceProperties;
+			vkGetPhysicalDeviceProperties(devices[i], &deviceProperties);
+
+			int64_t score = scoreDevice(devices[i]);
+			bool named = requested != nullptr && (byIndex ? std::to_string(i) == requested : std::string(deviceProperties.deviceName).find(requested) != std::string::npos);
+
+			std::cout << "Device " << i << ": " << deviceProperties.deviceName << (score < 0 ? " (unsuitable)" : " (score " + std::to_string(score) + ")") << std::endl;
+
+			if (named && score >= 0) { //overrides everything else
+				if (namedCount++ == 0) {
+					physicalDevice = devices[i];
+					bestScore = std::numeric_limits<int64_t>::max();
+				}
+			} else if (score > bestScore) {
+				physicalDevice = devices[i];
+				bestScore = score;
 			}
 		}
 
 		if (physicalDevice == VK_NULL_HANDLE)
 			throw std::runtime_error("Failed to find a suitable GPU");
 
+		indicies = findQueueFamilies(physicalDevice); //scoring left the last device's families in here
+
+		VkPhysicalDeviceProperties chosen;
+		vkGetPhysicalDeviceProperties(physicalDevice, &chosen);
+
+		if (requested != nullptr && namedCount == 0)
+			std::cout << "VULKAN_DEVICE=" << requested << " doesn't name a usable device, falling back to the best scoring one." << std::endl;
+		else if (namedCount > 1)
+			std::cout << "VULKAN_DEVICE=" << requested << " matches " << namedCount << " usable devices, taking the first - use its index to pick another." << std::endl;
+
+		std::cout << "Using " << chosen.deviceName << std::endl;
 	}
 
-	bool isDeviceSuitable(VkPhysicalDevice device) {
+	int64_t scoreDevice(VkPhysicalDevice device) {
+		//-1 if the device can't run the app, otherwise higher is better - device type dominates, memory, limits and optional features break ties
+		if (!isDeviceSuitable(device))
+			return -1;
+
 		VkPhysicalDeviceProperties deviceProperties;
 		vkGetPhysicalDeviceProperties(device, &deviceProperties);
 
 		VkPhysicalDeviceFeatures deviceFeatures;
 		vkGetPhysicalDeviceFeatures(device, &deviceFeatures);
 
-		if (!(deviceProperties.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU))
-			return false;
+		VkPhysicalDeviceMemoryProperties memProp;
+		vkGetPhysicalDeviceMemoryProperties(device, &memProp);
+
+		int64_t score = 0;
+
+		switch (deviceProperties.deviceType) {
+		case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU: score += 100000; break;
+		case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU: score += 50000; break;
+		case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU: score += 25000; break;
+		case VK_PHYSICAL_DEVICE_TYPE_CPU: score += 10000; break; //lavapipe, SwiftShader - slow but it runs
+		default: break;
+		}
 
+		VkDeviceSize largestLocalHeap = 0;
+		for (uint32_t i = 0; i < memProp.memoryHeapCount; i++)
+			if (memProp.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT)
+				largestLocalHeap = std::max(largestLocalHeap, memProp.memoryHeaps[i].size);
 
+		score += std::min<int64_t>(static_cast<int64_t>(largestLocalHeap / (64 * 1024 * 1024)), 5000); //64MB steps, capped below a device type step
+		score += deviceProperties.limits.maxImageDimension2D / 1024; //bigger texture array layers
+
+		if (deviceFeatures.samplerAnisotropy)
+			score += 500;
+		if (deviceProperties.limits.timestampComputeAndGraphics)
+			score += 100;
+
+		return score;
+	}
+
+	bool isDeviceSuitable(VkPhysicalDevice device) { //everything the app can't run without - anisotropy is optional
 		bool extentionsSupport = checkDeviceExtentionSupport(device);
 
 		indicies = findQueueFamilies(device);
@@ -488,7 +1405,11 @@ private:
 			swapChainSufficient = !swapChainSupport.formats.empty() && !swapChainSupport.presentModes.empty();
 		}
 
-		return indicies.isComplete() && swapChainSufficient && deviceFeatures.samplerAnisotropy;
+		VkPhysicalDeviceProperties props;
+		vkGetPhysicalDeviceProperties(device, &props);
+		bool descriptorsFit = props.limits.maxPerStageDescriptorSampledImages >= MAX_MATERIALS + 3 && props.limits.maxDescriptorSetSampledImages >= MAX_MATERIALS + 3; //a detail image per material, plus the array, page cache and indirection
+
+		return indicies.isComplete() && swapChainSufficient && descriptorsFit;
 	}
 
 	bool checkDeviceExtentionSupport(VkPhysicalDevice device) {
@@ -526,8 +1447,11 @@ private:
 			if (queueFamily.queueCount > 0 && presentSupport)
 				indicies.presentFamily = i;
 
-			if (indicies.isComplete())
-				break;
+			if (queueFamily.queueCount > 0 && (queueFamily.queueFlags & VK_QUEUE_TRANSFER_BIT) && !(queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT)) {
+				bool transferOnly = !(queueFamily.queueFlags & VK_QUEUE_COMPUTE_BIT); //the DMA engine, otherwise settle for an async compute family
+				if (indicies.transferFamily < 0 || (transferOnly && (queueFamilies[indicies.transferFamily].queueFlags & VK_QUEUE_COMPUTE_BIT)))
+					indicies.transferFamily = i;
+			}
 
 			i++;
 		}
@@ -540,6 +1464,8 @@ private:
 
 		std::vector<VkDeviceQueueCreateInfo> queueCreateInfos;
 		std::set<int> uniqueFamilies = { indicies.graphicsFamily, indicies.presentFamily };
+		if (indicies.transferFamily >= 0)
+			uniqueFamilies.insert(indicies.transferFamily);
 
 		float queuePriority = 1.0f;
 		for (int queueFamily : uniqueFamilies) {
@@ -554,8 +1480,14 @@ private:
 
 
 
+		VkPhysicalDeviceFeatures supportedFeatures;
+		vkGetPhysicalDeviceFeatures(physicalDevice, &supportedFeatures);
+		anisotropySupported = supportedFeatures.samplerAnisotropy == VK_TRUE;
+		detailStreaming = supportedFeatures.shaderSampledImageArrayDynamicIndexing == VK_TRUE;
+
 		VkPhysicalDeviceFeatures deviceFeatures = {};
-		deviceFeatures.samplerAnisotropy = VK_TRUE;
+		deviceFeatures.samplerAnisotropy = anisotropySupported ? VK_TRUE : VK_FALSE;
+		deviceFeatures.shaderSampledImageArrayDynamicIndexing = detailStreaming ? VK_TRUE : VK_FALSE; //detail images are picked by material, the same across a draw
 
 		VkDeviceCreateInfo createInfo = {};
 		createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
@@ -580,10 +1512,12 @@ private:
 
 		vkGetDeviceQueue(device, indicies.graphicsFamily, 0, &graphicsQueue);
 		vkGetDeviceQueue(device, indicies.presentFamily, 0, &presentQueue);
+		if (indicies.transferFamily >= 0)
+			vkGetDeviceQueue(device, indicies.transferFamily, 0, &transferQueue);
 	}
 
 
-	void createSwapChain() {
+	void createSwapChain(VkSwapchainKHR oldSwapChain = VK_NULL_HANDLE) {
 		SwapChainSupportDetails swapChainSupport = querySwapChainSupport(physicalDevice);
 
 		VkSurfaceFormatKHR surfaceFormat = chooseSwapSurfaceFormat(swapChainSupport.formats);
@@ -621,7 +1555,7 @@ private:
 		createInfo.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
 		createInfo.presentMode = presentMode;
 		createInfo.clipped = VK_TRUE;
-		createInfo.oldSwapchain = VK_NULL_HANDLE;
+		createInfo.oldSwapchain = oldSwapChain; //lets the driver hand over images still being presented instead of stalling
 
 		if (vkCreateSwapchainKHR(device, &createInfo, nullptr, &swapChain) != VK_SUCCESS)
 			throw std::runtime_error("Failed to create swapchain.");
@@ -686,10 +1620,7 @@ private:
 		if (capabilities.currentExtent.width != std::numeric_limits<uint32_t>::max()) {
 			return capabilities.currentExtent;
 		} else {
-			int width, height;
-			glfwGetWindowSize(window, &width, &height);
-
-			VkExtent2D actualExtent = { static_cast<uint32_t>(width), static_cast<uint32_t>(height) };
+			VkExtent2D actualExtent = { static_cast<uint32_t>(windowWidth), static_cast<uint32_t>(windowHeight) }; //glfw's size queries are main thread only
 
 			actualExtent.width = std::max(capabilities.minImageExtent.width, std::min(capabilities.maxImageExtent.width, actualExtent.width));
 			actualExtent.height = std::max(capabilities.minImageExtent.height, std::min(capabilities.maxImageExtent.height, actualExtent.height));
@@ -720,11 +1651,11 @@ private:
 		VkImageSubresourceRange subresourceRange = {};
 		subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
 		subresourceRange.baseMipLevel = 0;
-		subresourceRange.levelCount = 1;
+		subresourceRange.levelCount = texMipLevels;
 		subresourceRange.baseArrayLayer = 0;
-		subresourceRange.layerCount = 1;
+		subresourceRange.layerCount = texLayerCount;
 
-		ovgfCreateImageView(texImage, VK_IMAGE_VIEW_TYPE_2D, VK_FORMAT_R8G8B8A8_UNORM, { VK_COMPONENT_SWIZZLE_IDENTITY }, subresourceRange, &texImgView);
+		ovgfCreateImageView(texImage, VK_IMAGE_VIEW_TYPE_2D_ARRAY, VK_FORMAT_R8G8B8A8_UNORM, { VK_COMPONENT_SWIZZLE_IDENTITY }, subresourceRange, &texImgView);
 	}
 
 	void ovgfCreateImageView(VkImage image, VkImageViewType viewType, VkFormat format, VkComponentMapping componentStettings, VkImageSubresourceRange range, VkImageView *view) {
@@ -757,8 +1688,8 @@ private:
 		samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT;
 		samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT;
 
-		samplerInfo.anisotropyEnable = VK_TRUE;
-		samplerInfo.maxAnisotropy = 16;
+		samplerInfo.anisotropyEnable = anisotropySupported ? VK_TRUE : VK_FALSE; //not every device scoring can pick has it
+		samplerInfo.maxAnisotropy = anisotropySupported ? 16.0f : 1.0f;
 		samplerInfo.borderColor = VK_BORDER_COLOR_INT_OPAQUE_BLACK;
 
 		samplerInfo.unnormalizedCoordinates = VK_FALSE;
@@ -768,10 +1699,15 @@ private:
 		samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
 		samplerInfo.mipLodBias = 0.0f;
 		samplerInfo.minLod = 0.0f;
-		samplerInfo.maxLod = 0.0f;
+		samplerInfo.maxLod = static_cast<float>(texMipLevels); //the shader clamps to levels whose gutter is intact
 
 		if (vkCreateSampler(device, &samplerInfo, nullptr, &texSampler) != VK_SUCCESS)
 			throw std::runtime_error("Failed to create image views");
+
+		samplerInfo.maxLod = VK_LOD_CLAMP_NONE; //detail images are rebuilt with exactly the resident levels, there's nothing to clamp
+
+		if (vkCreateSampler(device, &samplerInfo, nullptr, &detailSampler) != VK_SUCCESS)
+			throw std::runtime_error("Failed to create detail sampler");
 	}
 
 
@@ -791,10 +1727,7 @@ private:
 		colorAttachmentRef.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
 
 		VkAttachmentDescription depthAttachment = {};
-		depthAttachment.format = findSupportedFormat(
-		{ VK_FORMAT_D32_SFLOAT, VK_FORMAT_D32_SFLOAT_S8_UINT, VK_FORMAT_D24_UNORM_S8_UINT },
-			VK_IMAGE_TILING_OPTIMAL,
-			VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT);
+		depthAttachment.format = findDepthFormat();
 		depthAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
 		depthAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
 		depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
@@ -817,11 +1750,11 @@ private:
 		dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
 		dependency.dstSubpass = 0;
 
-		dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-		dependency.srcAccessMask = 0;
+		dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT; //the depth image is shared by every frame in flight
+		dependency.srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
 
-		dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-		dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+		dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
+		dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
 
 		std::array<VkAttachmentDescription, 2> attachments = { colorAttachment, depthAttachment };
 
@@ -846,8 +1779,8 @@ private:
 		VkDescriptorSetLayoutBinding uboLB = {};
 		uboLB.binding = 0;
 		uboLB.descriptorCount = 1;
-		uboLB.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-		uboLB.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+		uboLB.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC; //offset picks the frame's slot at bind time
+		uboLB.stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT; //the fragment stage reads the lighting
 		uboLB.pImmutableSamplers = nullptr;
 
 		VkDescriptorSetLayoutBinding samplerLB = {};
@@ -857,7 +1790,49 @@ private:
 		samplerLB.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
 		samplerLB.pImmutableSamplers = nullptr;
 
-		std::array<VkDescriptorSetLayoutBinding, 2> bindings = { uboLB, samplerLB };
+		VkDescriptorSetLayoutBinding materialLB = {};
+		materialLB.binding = 2;
+		materialLB.descriptorCount = 1;
+		materialLB.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+		materialLB.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+		materialLB.pImmutableSamplers = nullptr;
+
+		VkDescriptorSetLayoutBinding vtInfoLB = {};
+		vtInfoLB.binding = 3;
+		vtInfoLB.descriptorCount = 1;
+		vtInfoLB.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+		vtInfoLB.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+		vtInfoLB.pImmutableSamplers = nullptr;
+
+		VkDescriptorSetLayoutBinding vtCacheLB = {};
+		vtCacheLB.binding = 4;
+		vtCacheLB.descriptorCount = 1;
+		vtCacheLB.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+		vtCacheLB.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+		vtCacheLB.pImmutableSamplers = nullptr;
+
+		VkDescriptorSetLayoutBinding vtIndirectionLB = {};
+		vtIndirectionLB.binding = 5;
+		vtIndirectionLB.descriptorCount = 1;
+		vtIndirectionLB.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+		vtIndirectionLB.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+		vtIndirectionLB.pImmutableSamplers = nullptr;
+
+		VkDescriptorSetLayoutBinding detailLB = {};
+		detailLB.binding = 6;
+		detailLB.descriptorCount = MAX_MATERIALS; //one per material, indexed by the material a draw uses
+		detailLB.descriptorType = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
+		detailLB.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+		detailLB.pImmutableSamplers = nullptr;
+
+		VkDescriptorSetLayoutBinding detailSamplerLB = {};
+		detailSamplerLB.binding = 7;
+		detailSamplerLB.descriptorCount = 1; //shared by every detail image, so the array doesn't eat into the sampler limit
+		detailSamplerLB.descriptorType = VK_DESCRIPTOR_TYPE_SAMPLER;
+		detailSamplerLB.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+		detailSamplerLB.pImmutableSamplers = nullptr;
+
+		std::array<VkDescriptorSetLayoutBinding, 8> bindings = { uboLB, samplerLB, materialLB, vtInfoLB, vtCacheLB, vtIndirectionLB, detailLB, detailSamplerLB };
 
 		VkDescriptorSetLayoutCreateInfo layoutInfo = {};
 		layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
@@ -872,14 +1847,74 @@ private:
 
 
 	void createGraphicsPipeline() {
-		auto vertShaderCode = readFile("shaders/vert.spv");
-		auto fragShaderCode = readFile("shaders/frag.spv");
+		VkPipelineLayoutCreateInfo pipelineLayoutInfo = {};
+		pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+		pipelineLayoutInfo.setLayoutCount = 1;
+		pipelineLayoutInfo.pSetLayouts = &desSetLayout;
+		VkPushConstantRange pushConstantRange = {};
+		pushConstantRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+		pushConstantRange.offset = 0;
+		pushConstantRange.size = sizeof(DrawPushConstants);
+
+		pipelineLayoutInfo.pushConstantRangeCount = 1;
+		pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+
+		if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &pipelineLayout) != VK_SUCCESS)
+				throw std::runtime_error("Failed to create pipeline layout.");
+
+		if (const char *lighting = std::getenv("LIGHTING"))
+			foldLighting = std::string(lighting) != "uniform";
+
+		graphicsPipeline = buildGraphicsPipeline("shaders/vert.spv", "shaders/frag.spv", renderPass, lightingSpecialization(LIGHTING_UNIFORM));
+	}
+
+	std::vector<uint32_t> lightingSpecialization(LightingMode mode) const { //constant_id 0 is the mode, 1 to 9 the light values as float bits
+		if (mode == LIGHTING_UNIFORM) //the values are unused, keeping them out keeps one key for every lighting
+			return { mode };
+
+		const glm::vec3 values[] = { sceneLighting.ambient, sceneLighting.intensity, glm::normalize(sceneLighting.direction) };
+
+		std::vector<uint32_t> words(10);
+		words[0] = mode;
+		memcpy(&words[1], values, sizeof(values)); //glm vec3s are three packed floats
+		return words;
+	}
 
+	PipelineVariant sceneVariant() const { //the scene pipeline with the current lighting folded in
+		return { "shaders/vert.spv", "shaders/frag.spv", renderPass, lightingSpecialization(LIGHTING_CONSTANT) };
+	}
+
+	void setSceneLighting(const LightingParams &lighting) { //takes effect at once through the ubo, the folded variant swaps in when it has compiled
+		PipelineVariant previous = sceneVariant();
+		sceneLighting = lighting;
+
+		if (!foldLighting)
+			return;
+
+		PipelineVariant next = sceneVariant();
+		if (previous < next || next < previous) { //the old lighting won't be asked for again, don't keep a pipeline per lighting ever set
+			retirePipelineVariant(previous);
+			compilePipelineAsync(next);
+		}
+	}
+
+	void selectScenePipeline() { //start of each frame, re-records the draws if the pipeline to use has changed
+		VkPipeline wanted = foldLighting ? readyPipeline(sceneVariant()) : VK_NULL_HANDLE;
+		if (wanted == VK_NULL_HANDLE)
+			wanted = graphicsPipeline; //draws the same image, just reads the light from the ubo
+
+		if (wanted != scenePipeline) {
+			scenePipeline = wanted;
+			markDrawsDirty(0, drawList.size());
+		}
+	}
+
+	VkPipeline buildGraphicsPipeline(const std::string &vertPath, const std::string &fragPath, VkRenderPass pass, const std::vector<uint32_t> &specialization = std::vector<uint32_t>()) { //shares pipelineLayout, so every pipeline sees the same descriptor set - viewport and scissor are dynamic so a resize doesn't invalidate it
 		VkShaderModule vertShaderModule;
 		VkShaderModule fragShaderModule;
 
-		vertShaderModule = createShaderModule(vertShaderCode);
-		fragShaderModule = createShaderModule(fragShaderCode);
+		vertShaderModule = loadShaderModule(vertPath);
+		fragShaderModule = loadShaderModule(fragPath);
 
 		VkPipelineShaderStageCreateInfo vertShaderStageInfo = {};
 		vertShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
@@ -893,6 +1928,18 @@ private:
 		fragShaderStageInfo.module = fragShaderModule;
 		fragShaderStageInfo.pName = "main";
 
+		std::vector<VkSpecializationMapEntry> specEntries(specialization.size());
+		for (uint32_t i = 0; i < specEntries.size(); i++)
+			specEntries[i] = { i, i * static_cast<uint32_t>(sizeof(uint32_t)), sizeof(uint32_t) };
+
+		VkSpecializationInfo specInfo = {};
+		specInfo.mapEntryCount = static_cast<uint32_t>(specEntries.size());
+		specInfo.pMapEntries = specEntries.data();
+		specInfo.dataSize = specialization.size() * sizeof(uint32_t);
+		specInfo.pData = specialization.data();
+
+		fragShaderStageInfo.pSpecializationInfo = specialization.empty() ? nullptr : &specInfo;
+
 		VkPipelineShaderStageCreateInfo shaderStages[] = { vertShaderStageInfo, fragShaderStageInfo };
 
 		VkPipelineVertexInputStateCreateInfo vertexInputInfo = {};
@@ -911,25 +1958,12 @@ private:
 		inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
 		inputAssembly.primitiveRestartEnable = VK_FALSE;
 
-		VkViewport viewport = {};
-		viewport.x = 0.0f;
-		viewport.y = 0.0f;
-
-		viewport.width = (float)swapChainExtent.width;
-		viewport.height = (float)swapChainExtent.height;
-		viewport.minDepth = 0.0f;
-		viewport.maxDepth = 1.0f;
-
-		VkRect2D scissor = {};
-		scissor.offset = { 0, 0 };
-		scissor.extent = swapChainExtent;
-
 		VkPipelineViewportStateCreateInfo viewportState = {};
 		viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
 		viewportState.scissorCount = 1;
-		viewportState.pScissors = &scissor;
+		viewportState.pScissors = nullptr; //set with setViewport when recording
 		viewportState.viewportCount = 1;
-		viewportState.pViewports = &viewport;
+		viewportState.pViewports = nullptr;
 
 		VkPipelineRasterizationStateCreateInfo rasterizer = {};
 		rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
@@ -974,27 +2008,15 @@ private:
 		colorBlend.blendConstants[2] = 0.0f; // Optional
 		colorBlend.blendConstants[3] = 0.0f; // Optional
 
-		/* Dynamic State Config
-
 		VkDynamicState dynamicStates[] = {
 			VK_DYNAMIC_STATE_VIEWPORT,
-			VK_DYNAMIC_STATE_LINE_WIDTH
+			VK_DYNAMIC_STATE_SCISSOR
 		};
 
 		VkPipelineDynamicStateCreateInfo dynamicState = {};
 		dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
 		dynamicState.dynamicStateCount = 2;
-		dynamicState.pDynamicStates = dynamicStates;*/
-
-		VkPipelineLayoutCreateInfo pipelineLayoutInfo = {};
-		pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-		pipelineLayoutInfo.setLayoutCount = 1;
-		pipelineLayoutInfo.pSetLayouts = &desSetLayout;
-		pipelineLayoutInfo.pushConstantRangeCount = 0;
-		pipelineLayoutInfo.pPushConstantRanges = 0;
-
-		if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &pipelineLayout) != VK_SUCCESS)
-				throw std::runtime_error("Failed to create pipeline layout.");
+		dynamicState.pDynamicStates = dynamicStates;
 
 		VkPipelineDepthStencilStateCreateInfo depthStencil = {};
 		depthStencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
@@ -1020,26 +2042,440 @@ private:
 		pipelineInfo.pMultisampleState = &multisampling;
 		pipelineInfo.pDepthStencilState = &depthStencil;
 		pipelineInfo.pColorBlendState = &colorBlend;
-		pipelineInfo.pDynamicState = nullptr;
+		pipelineInfo.pDynamicState = &dynamicState;
 		pipelineInfo.layout = pipelineLayout;
-		pipelineInfo.renderPass = renderPass;
+		pipelineInfo.renderPass = pass;
 		pipelineInfo.subpass = 0;
 		pipelineInfo.basePipelineHandle = VK_NULL_HANDLE; // Optional
 		pipelineInfo.basePipelineIndex = -1; // Optional
 
-		if (vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &graphicsPipeline) != VK_SUCCESS)
+		VkPipeline pipeline;
+		if (vkCreateGraphicsPipelines(device, pipelineCache, 1, &pipelineInfo, nullptr, &pipeline) != VK_SUCCESS)
 			throw std::runtime_error("Failed to create graphics pipeline.");
 
 
 		vkDestroyShaderModule(device, fragShaderModule, nullptr);
 		vkDestroyShaderModule(device, vertShaderModule, nullptr);
+		return pipeline;
+	}
+
+	std::string pipelineCachePath() const {
+		const char *path = std::getenv("PIPELINE_CACHE");
+		return path ? path : PIPELINE_CACHE_FILE;
+	}
+
+	std::vector<char> loadPipelineCacheData() { //the driver blob from disk, empty if there's none or it was made by a different device or driver
+		std::string path = pipelineCachePath();
+		if (!std::ifstream(path).good())
+			return {};
+
+		std::vector<char> file = readFile(path);
+
+		VkPhysicalDeviceProperties props;
+		vkGetPhysicalDeviceProperties(physicalDevice, &props);
+
+		PipelineCachePrefix prefix;
+		PipelineCacheHeader header;
+		if (file.size() < sizeof(prefix) + sizeof(header))
+			return {};
+
+		memcpy(&prefix, file.data(), sizeof(prefix));
+		memcpy(&header, file.data() + sizeof(prefix), sizeof(header));
+
+		if (prefix.magic != PIPELINE_CACHE_MAGIC || prefix.driverVersion != props.driverVersion || prefix.dataSize != file.size() - sizeof(prefix)
+			|| header.headerSize < sizeof(header) || header.headerVersion != VK_PIPELINE_CACHE_HEADER_VERSION_ONE
+			|| header.vendorID != props.vendorID || header.deviceID != props.deviceID || memcmp(header.pipelineCacheUUID, props.pipelineCacheUUID, VK_UUID_SIZE) != 0) {
+			std::cout << "Pipeline cache " << path << " is stale or from another device, starting cold." << std::endl;
+			return {};
+		}
+
+		return std::vector<char>(file.begin() + sizeof(prefix), file.end());
+	}
+
+	void createPipelineCache() {
+		std::vector<char> data = loadPipelineCacheData();
+
+		VkPipelineCacheCreateInfo cacheInfo = {};
+		cacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+		cacheInfo.initialDataSize = data.size();
+		cacheInfo.pInitialData = data.empty() ? nullptr : data.data();
+
+		if (vkCreatePipelineCache(device, &cacheInfo, nullptr, &pipelineCache) != VK_SUCCESS)
+			throw std::runtime_error("Failed to create pipeline cache.");
+
+#ifndef NDEBUG
+		if (data.empty())
+			std::cout << "Pipeline cache: cold." << std::endl;
+		else
+			std::cout << "Pipeline cache: warm, " << data.size() << " bytes." << std::endl;
+#endif
+	}
+
+	void savePipelineCache() { //a failed save only costs the next launch its warm start
+		size_t size = 0;
+		if (vkGetPipelineCacheData(device, pipelineCache, &size, nullptr) != VK_SUCCESS || size == 0)
+			return;
+
+		std::vector<char> data(size);
+		if (vkGetPipelineCacheData(device, pipelineCache, &size, data.data()) != VK_SUCCESS)
+			return;
+
+		VkPhysicalDeviceProperties props;
+		vkGetPhysicalDeviceProperties(physicalDevice, &props);
+
+		PipelineCachePrefix prefix = { PIPELINE_CACHE_MAGIC, props.driverVersion, size };
+
+		std::ofstream file(pipelineCachePath(), std::ios::binary | std::ios::trunc);
+		file.write(reinterpret_cast<const char *>(&prefix), sizeof(prefix));
+		file.write(data.data(), size);
+	}
+
+	std::vector<PipelineVariant> declaredPipelineVariants() const { //every variant the renderer may ask for, compiled up front so none of them hitch on first use
+		std::vector<PipelineVariant> variants;
+		if (!virtualTextures.empty())
+			variants.push_back(feedbackVariant);
+		if (foldLighting)
+			variants.push_back(sceneVariant());
+		return variants;
+	}
+
+	void compilePipelineAsync(const PipelineVariant &variant) { //no-op if it's already compiled or compiling
+		if (pipelineVariants.count(variant))
+			return;
+
+		pipelineVariants[variant].future = std::async(std::launch::async, [this, variant] { //vkCreateGraphicsPipelines is safe to call from any thread, the cache synchronises itself
+			return buildGraphicsPipeline(variant.vertPath, variant.fragPath, variant.pass, variant.specialization);
+		}).share();
+	}
+
+	void prewarmPipelines(const std::vector<PipelineVariant> &variants) {
+		for (const auto &variant : variants)
+			compilePipelineAsync(variant);
+	}
+
+	VkPipeline readyPipeline(const PipelineVariant &variant) { //VK_NULL_HANDLE until it has compiled, the caller draws with a fallback or skips the draw
+		compilePipelineAsync(variant);
+
+		AsyncPipeline &pending = pipelineVariants[variant];
+		if (pending.pipeline == VK_NULL_HANDLE && pending.future.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+			pending.pipeline = pending.future.get(); //rethrows a failed compile here on the render thread
+
+		return pending.pipeline;
+	}
+
+	void retirePipelineVariant(const PipelineVariant &variant) { //for variants the renderer won't ask for again
+		auto found = pipelineVariants.find(variant);
+		if (found == pipelineVariants.end())
+			return;
+
+		if (found->second.pipeline != VK_NULL_HANDLE)
+			deferDestroyPipeline(found->second.pipeline, gpuNow()); //recorded frames may still bind it
+		else
+			retiredCompiles.push_back(found->second.future); //never handed out, reapRetiredCompiles destroys it once it's done
+
+		pipelineVariants.erase(found);
+	}
+
+	void reapRetiredCompiles() { //never blocks
+		for (auto it = retiredCompiles.begin(); it != retiredCompiles.end();) {
+			if (it->wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+				++it;
+				continue;
+			}
+
+			destroyCompiledPipeline(*it);
+			it = retiredCompiles.erase(it);
+		}
+	}
+
+	void destroyCompiledPipeline(const std::shared_future<VkPipeline> &future) { //waits for it, a failed compile has nothing to destroy
+		try {
+			vkDestroyPipeline(device, future.get(), nullptr);
+		} catch (const std::runtime_error &) {
+		}
+	}
+
+	void destroyPipelineVariants() { //waits for anything still compiling so it makes it into the saved cache
+		for (auto &variant : pipelineVariants) {
+			if (variant.second.pipeline != VK_NULL_HANDLE)
+				vkDestroyPipeline(device, variant.second.pipeline, nullptr);
+			else
+				destroyCompiledPipeline(variant.second.future);
+		}
+		pipelineVariants.clear();
+
+		for (auto &future : retiredCompiles)
+			destroyCompiledPipeline(future);
+		retiredCompiles.clear();
+	}
+
+	bool reloadedShader(const std::string &spvPath, std::vector<uint32_t> &code) { //hot reload's compile of spvPath's source if there is one, called from the compile threads
+		std::lock_guard<std::mutex> lock(shaderMutex);
+		auto found = shaderBinaries.find(spvPath);
+		if (found == shaderBinaries.end())
+			return false;
+
+		code = found->second;
+		return true;
+	}
+
+	static bool compileShader(const shaderc::Compiler &compiler, const ShaderSource &shader, const std::string &source, std::vector<uint32_t> &code) {
+		shaderc::CompileOptions options;
+		shaderc::SpvCompilationResult result = compiler.CompileGlslToSpv(source, shader.kind, shader.sourcePath.c_str(), options);
+
+		if (result.GetCompilationStatus() != shaderc_compilation_status_success) {
+			std::cout << "Shader reload: " << result.GetErrorMessage() << std::endl;
+			return false;
+		}
+
+		code.assign(result.cbegin(), result.cend());
+		return true;
+	}
+
+	static bool readShaderCache(const std::string &path, uint64_t sourceHash, std::vector<uint32_t> &code) {
+		std::string bytes = readBytes(path);
+		ShaderCacheHeader header;
+
+		if (bytes.size() < sizeof(header))
+			return false;
+
+		memcpy(&header, bytes.data(), sizeof(header));
+		if (header.magic != SHADER_CACHE_MAGIC || header.sourceHash != sourceHash || header.wordCount == 0
+			|| bytes.size() != sizeof(header) + static_cast<size_t>(header.wordCount) * sizeof(uint32_t))
+			return false;
+
+		code.resize(header.wordCount);
+		memcpy(code.data(), bytes.data() + sizeof(header), code.size() * sizeof(uint32_t));
+		return code[0] == SPIRV_MAGIC;
+	}
+
+	static void writeShaderCache(const std::string &path, uint64_t sourceHash, const std::vector<uint32_t> &code) { //a failed write only costs a recompile next launch
+		std::string temp = path + ".tmp"; //written whole, then renamed over the old entry, so nothing ever reads half a file
+		{
+			std::ofstream file(temp, std::ios::binary | std::ios::trunc);
+			ShaderCacheHeader header = { SHADER_CACHE_MAGIC, static_cast<uint32_t>(code.size()), sourceHash };
+			file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+			file.write(reinterpret_cast<const char *>(code.data()), static_cast<std::streamsize>(code.size() * sizeof(uint32_t)));
+
+			if (!file) {
+				file.close();
+				std::remove(temp.c_str());
+				return;
+			}
+		}
+
+		std::remove(path.c_str()); //rename won't replace an existing file on windows
+		if (std::rename(temp.c_str(), path.c_str()) != 0)
+			std::remove(temp.c_str());
+	}
+
+	std::string loadedShaderBytes(const std::string &spvPath) const { //mirrors loadShaderModule before any reload
+#ifndef NDEBUG
+		if (std::ifstream(spvPath).good())
+			return readBytes(spvPath);
+#endif
+		const EmbeddedShader *shader = findEmbeddedShader(spvPath);
+		return shader != nullptr ? std::string(reinterpret_cast<const char *>(shader->code), shader->codeSize) : std::string();
+	}
+
+	void startShaderWatcher() {
+		bool enabled = true;
+#ifdef NDEBUG
+		enabled = false;
+#endif
+		if (const char *reload = std::getenv("SHADER_HOT_RELOAD"))
+			enabled = std::string(reload) != "0";
+
+		if (enabled)
+			shaderWatcher = std::thread(&TriangleBasicsApp::shaderWatcherLoop, this);
+	}
+
+	void shaderWatcherLoop() { //polls the sources, the first pass brings the loaded .spv files up to date with them
+		shaderc::Compiler compiler;
+		std::map<std::string, uint64_t> hashes;
+
+		while (true) {
+			for (const auto &shader : SHADER_SOURCES) {
+				if (!std::ifstream(shader.sourcePath).good()) //shipped without sources
+					continue;
+
+				std::string source = readBytes(shader.sourcePath);
+				uint64_t hash = hashBytes(source);
+				bool firstPass = !hashes.count(shader.sourcePath);
+				if (!firstPass && hashes[shader.sourcePath] == hash) //also catches a save that changed nothing
+					continue;
+				hashes[shader.sourcePath] = hash;
+
+				std::vector<uint32_t> code;
+				std::string cachePath = shader.spvPath + ".cache"; //an unchanged source starts without compiling anything
+
+				if (!readShaderCache(cachePath, hash, code)) {
+					if (!compileShader(compiler, shader, source, code)) {
+						std::cout << "Shader reload: " << shader.sourcePath << " failed to compile, keeping the old one." << std::endl;
+						continue;
+					}
+
+					writeShaderCache(cachePath, hash, code);
+				}
+
+				if (firstPass && std::string(reinterpret_cast<const char *>(code.data()), code.size() * sizeof(uint32_t)) == loadedShaderBytes(shader.spvPath)) //what's loaded is current, nothing to rebuild
+					continue;
+
+				std::lock_guard<std::mutex> lock(shaderMutex);
+				shaderBinaries[shader.spvPath] = std::move(code);
+				shadersChanged.push_back(shader.spvPath);
+			}
+
+			std::unique_lock<std::mutex> lock(shaderMutex);
+			if (shaderWake.wait_for(lock, std::chrono::milliseconds(SHADER_WATCH_INTERVAL_MS), [this] { return shaderWatcherStop; }))
+				return;
+		}
+	}
+
+	void stopShaderWatcher() {
+		if (!shaderWatcher.joinable())
+			return;
+
+		{
+			std::lock_guard<std::mutex> lock(shaderMutex);
+			shaderWatcherStop = true;
+		}
+
+		shaderWake.notify_one();
+		shaderWatcher.join();
+	}
+
+	void reloadPipeline(const PipelineVariant &variant, bool fallback) {
+		for (auto it = reloadingPipelines.begin(); it != reloadingPipelines.end();) { //an older edit still building, this one supersedes it
+			if (it->fallback == fallback && !(it->variant < variant) && !(variant < it->variant)) {
+				retiredCompiles.push_back(it->future);
+				it = reloadingPipelines.erase(it);
+			} else {
+				++it;
+			}
+		}
+
+		PipelineReload reload;
+		reload.variant = variant;
+		reload.fallback = fallback;
+		reload.future = std::async(std::launch::async, [this, variant] {
+			return buildGraphicsPipeline(variant.vertPath, variant.fragPath, variant.pass, variant.specialization);
+		}).share();
+		reloadingPipelines.push_back(reload);
+	}
+
+	void applyShaderReloads() { //render thread, starts rebuilding pipelines that use changed shaders and swaps in the ones that are done
+		std::vector<std::string> changed;
+		{
+			std::lock_guard<std::mutex> lock(shaderMutex);
+			changed.swap(shadersChanged);
+		}
+
+		if (!changed.empty()) {
+			auto uses = [&changed](const PipelineVariant &variant) {
+				return std::find(changed.begin(), changed.end(), variant.vertPath) != changed.end() || std::find(changed.begin(), changed.end(), variant.fragPath) != changed.end();
+			};
+
+			for (const auto &entry : pipelineVariants)
+				if (uses(entry.first))
+					reloadPipeline(entry.first, false);
+
+			PipelineVariant fallback = { "shaders/vert.spv", "shaders/frag.spv", renderPass, lightingSpecialization(LIGHTING_UNIFORM) };
+			if (uses(fallback))
+				reloadPipeline(fallback, true);
+		}
+
+		for (auto it = reloadingPipelines.begin(); it != reloadingPipelines.end();) {
+			if (it->future.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+				++it;
+				continue;
+			}
+
+			VkPipeline pipeline;
+			try {
+				pipeline = it->future.get();
+			} catch (const std::runtime_error &e) { //e.g. a stage interface mismatch, keep drawing with the old one
+				std::cout << "Shader reload: " << e.what() << std::endl;
+				it = reloadingPipelines.erase(it);
+				continue;
+			}
+
+			if (it->fallback) {
+				if (it->variant.pass != renderPass) { //a format change replaced the pass while it built, never bound
+					vkDestroyPipeline(device, pipeline, nullptr);
+					it = reloadingPipelines.erase(it);
+					continue;
+				}
+
+				deferDestroyPipeline(graphicsPipeline, gpuNow());
+				graphicsPipeline = pipeline;
+			} else {
+				auto entry = pipelineVariants.find(it->variant);
+				if (entry == pipelineVariants.end()) { //retired while it built, nothing will ask for it
+					vkDestroyPipeline(device, pipeline, nullptr);
+					it = reloadingPipelines.erase(it);
+					continue;
+				}
+
+				if (entry->second.pipeline != VK_NULL_HANDLE) {
+					deferDestroyPipeline(entry->second.pipeline, gpuNow()); //recorded frames may still bind it
+				} else if (entry->second.future.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+					retiredCompiles.push_back(entry->second.future); //never handed out, or failed - reaped next frame either way
+				} else {
+					++it; //the original is still compiling, swap once it's done rather than block the render thread on it
+					continue;
+				}
+
+				entry->second.pipeline = pipeline;
+				entry->second.future = it->future;
+			}
+
+			std::cout << "Shader reload: swapped in " << it->variant.fragPath << " pipeline." << std::endl;
+			it = reloadingPipelines.erase(it);
+		}
+	}
+
+	void setViewport(VkCommandBuffer commandBuffer, VkExtent2D extent) { //dynamic state, every command buffer drawing with our pipelines has to set it
+		VkViewport viewport = {};
+		viewport.x = 0.0f;
+		viewport.y = 0.0f;
+		viewport.width = (float)extent.width;
+		viewport.height = (float)extent.height;
+		viewport.minDepth = 0.0f;
+		viewport.maxDepth = 1.0f;
+
+		VkRect2D scissor = {};
+		scissor.offset = { 0, 0 };
+		scissor.extent = extent;
+
+		vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+		vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+	}
+
+	VkShaderModule loadShaderModule(const std::string &spvPath) { //embedded code, no file io - unless hot reload compiled a newer one or a development build finds the .spv on disk
+		std::vector<uint32_t> reloaded;
+		if (reloadedShader(spvPath, reloaded))
+			return createShaderModule(reloaded.data(), reloaded.size() * sizeof(uint32_t));
+#ifndef NDEBUG
+		if (std::ifstream(spvPath).good())
+			return createShaderModule(readFile(spvPath));
+#endif
+
+		const EmbeddedShader *shader = findEmbeddedShader(spvPath);
+		if (shader == nullptr)
+			throw std::runtime_error("No embedded shader " + spvPath);
+		return createShaderModule(shader->code, shader->codeSize);
 	}
 
 	VkShaderModule createShaderModule(const std::vector<char> &code) {
+		return createShaderModule(reinterpret_cast<const uint32_t *>(code.data()), code.size());
+	}
+
+	VkShaderModule createShaderModule(const uint32_t *code, size_t codeSize) {
 		VkShaderModuleCreateInfo createInfo = {};
 		createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-		createInfo.codeSize = code.size();
-		createInfo.pCode = reinterpret_cast<const uint32_t *>(code.data());
+		createInfo.codeSize = codeSize;
+		createInfo.pCode = code;
 
 		VkShaderModule shaderModule;
 		if (vkCreateShaderModule(device, &createInfo, nullptr, &shaderModule) != VK_SUCCESS)
@@ -1077,18 +2513,22 @@ private:
 		VkCommandPoolCreateInfo poolInfo = {};
 		poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
 		poolInfo.queueFamilyIndex = indicies.graphicsFamily;
-		poolInfo.flags = 0;
+		poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT; //frame primaries are re-recorded every frame
 
 		if (vkCreateCommandPool(device, &poolInfo, nullptr, &commandPool) != VK_SUCCESS)
 			throw std::runtime_error("Failed to create command pool.");
+
+		if (transferQueue != VK_NULL_HANDLE) {
+			poolInfo.queueFamilyIndex = indicies.transferFamily;
+
+			if (vkCreateCommandPool(device, &poolInfo, nullptr, &transferCommandPool) != VK_SUCCESS)
+				throw std::runtime_error("Failed to create transfer command pool.");
+		}
 	}
 
 
 	void createDepthResources() {
-		VkFormat depthFormat = findSupportedFormat(
-		{ VK_FORMAT_D32_SFLOAT, VK_FORMAT_D32_SFLOAT_S8_UINT, VK_FORMAT_D24_UNORM_S8_UINT },
-			VK_IMAGE_TILING_OPTIMAL,
-			VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT);
+		VkFormat depthFormat = findDepthFormat();
 
 		createImage(swapChainExtent.width, swapChainExtent.height,
 			depthFormat, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
@@ -1107,6 +2547,13 @@ private:
 		trasitionImageLayout(depthImage, depthFormat, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL);
 	}
 
+	VkFormat findDepthFormat() {
+		return findSupportedFormat(
+		{ VK_FORMAT_D32_SFLOAT, VK_FORMAT_D32_SFLOAT_S8_UINT, VK_FORMAT_D24_UNORM_S8_UINT },
+			VK_IMAGE_TILING_OPTIMAL,
+			VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT);
+	}
+
 	bool hasStencilComponent(VkFormat format) {
 		return format == VK_FORMAT_D32_SFLOAT_S8_UINT || format == VK_FORMAT_D24_UNORM_S8_UINT;
 	}
@@ -1127,97 +2574,1587 @@ private:
 		}
 	}
 
-	void createTextureImage(const std::string fileName) {
-		int texWidth, texHeight, texChannels; //vars to hold image data
-		stbi_uc *pixels = stbi_load((TEXTURE_PATH_ROOT + fileName).c_str(), &texWidth, &texHeight, &texChannels, STBI_rgb_alpha); //load the pixel data and force alpha channel even if missing
+	void createTextureImage(const std::vector<std::string> &fileNames) {
+		if (fileNames.empty() || fileNames.size() > MAX_MATERIALS)
+			throw std::runtime_error("Texture count must be between 1 and MAX_MATERIALS");
 
-		VkDeviceSize imageSize = texWidth * texHeight * 4; //pixel count * number of bytes
+		std::vector<PackedTexture> textures; //textures that go in the array
+		std::vector<uint32_t> virtualIds(fileNames.size(), NO_VIRTUAL_TEXTURE); //per material, the streamed texture it uses instead
 
-		if (!pixels) //we have no image if this goes off
-			throw std::runtime_error("Failed to load texture image " + fileName);
+		for (size_t t = 0; t < fileNames.size(); t++) {
+			int texWidth, texHeight, texChannels; //vars to hold image data
 
-		VkBuffer stageBuff; //staging buffer for the pixels
-		VkDeviceMemory stageBuffMem; //buffer device memory
+			if (!stbi_info((TEXTURE_PATH_ROOT + fileNames[t]).c_str(), &texWidth, &texHeight, &texChannels)) //only the header is needed to plan the layout
+				throw std::runtime_error("Failed to load texture image " + fileNames[t]);
 
-		//create buffer on the divice with a transfer source memory layout, the host visible and coherent flags, and the buffer/memory to fill
-		createBuffer(imageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stageBuff, stageBuffMem);
+			if (static_cast<uint32_t>(texWidth) >= VIRTUAL_TEXTURE_MIN_SIZE || static_cast<uint32_t>(texHeight) >= VIRTUAL_TEXTURE_MIN_SIZE) { //too big to keep resident, stream it instead
+				virtualIds[t] = createVirtualTexture(fileNames[t], static_cast<uint32_t>(texWidth), static_cast<uint32_t>(texHeight));
+				continue;
+			}
 
-		void *data; //void pointer for the trasfer
-		vkMapMemory(device, stageBuffMem, 0, imageSize, 0, &data); //map the buffer memory to our void pointer
-		memcpy(data, pixels, static_cast<size_t>(imageSize)); //copy the pixel data to the device
-		vkUnmapMemory(device, stageBuffMem); //unmap the memory
+			PackedTexture texture;
+			texture.fileName = fileNames[t];
+			texture.width = static_cast<uint32_t>(texWidth);
+			texture.height = static_cast<uint32_t>(texHeight);
+			texture.material = static_cast<uint32_t>(t);
+			textures.push_back(texture);
+		}
 
-		stbi_image_free(pixels); //free the host image memory
+		for (auto &texture : textures) { //only the small tail mips go in the atlas, updateTextureStreaming brings the rest into detail images once they're big enough on screen to matter
+			texture.mipCount = mipChainLength(std::max(texture.width, texture.height));
+			texture.tailMip = 0;
+			while (detailStreaming && texture.tailMip + 1 < texture.mipCount && (std::max(texture.width, texture.height) >> texture.tailMip) > MIP_STREAM_RESIDENT_SIZE)
+				texture.tailMip++;
+			texture.residentMip = texture.tailMip;
+			texture.alignMip = std::min(texture.mipCount - 1, texture.tailMip + ATLAS_MIN_ALIGN_MIP); //the tail is always sampleable, so the gutter has to hold there at least
+		}
 
-		createImage(texWidth, texHeight, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, 
-			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, texImage, texImageMem);
+		texLayerCount = packTextures(textures, texLayerWidth, texLayerHeight);
+		texMipLevels = mipChainLength(std::max(texLayerWidth, texLayerHeight));
 
-		trasitionImageLayout(texImage, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL); //transition from undef to transfer dest optimal
+		for (auto &texture : textures) {
+			texture.lastNeeded.assign(texture.mipCount, 0);
+			texture.mipPath = TEXTURE_PATH_ROOT + texture.fileName + ".mips";
 
-		copyBufferToImage(stageBuff, texImage, static_cast<uint32_t>(texWidth), static_cast<uint32_t>(texHeight)); //preform the copy
+			if (!mipFileMatches(texture, sourceStamp(TEXTURE_PATH_ROOT + texture.fileName))) //first run, or the source changed since its mips were built
+				buildMipFile(texture);
+		}
 
-		trasitionImageLayout(texImage, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL); //change from tranfer layout to shader read layout
+		createImage(texLayerWidth, texLayerHeight, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, 
+			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, texImage, texImageMem, texLayerCount, texMipLevels);
 
-		vkDestroyBuffer(device, stageBuff, nullptr); //destroy the staging buffer
-		vkFreeMemory(device, stageBuffMem, nullptr); //free the buffers memory
+		createDetailFallback();
 
-#ifndef NDEBUG
-		std::cout << "Finished loading texture." << std::endl;
-#endif
-	}
+		VkCommandBuffer commandBuffer = batchCommands(); //every layer gets transitioned, cleared and filled in as few submits as the staging buffer allows
 
-	void createImage(uint32_t width, uint32_t height, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage& image, VkDeviceMemory& imageMemory) {
-		VkImageCreateInfo imageInfo = {};
-		imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
-		imageInfo.imageType = VK_IMAGE_TYPE_2D; //texel coordinate system
-		imageInfo.extent.width = width; //width of the image
-		imageInfo.extent.height = height; //height of the image
-		imageInfo.extent.depth = 1; //no depth on a 2d image but still has one "row"
-		imageInfo.mipLevels = 1; //not an array of textures
-		imageInfo.arrayLayers = 1; //only one image layer
-		imageInfo.tiling = tiling; //using a staging buffer so we don't need texel access
-		imageInfo.format = format; //texel format
-		imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED; //we don't need to preserve any initial texel data
-		imageInfo.usage = usage; //the image is going to recieve data from our staging buffer and we need access to the image from the shader
-		imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE; //the graphics queue implicitly supports memory transfers so only one queue will use this image
-		imageInfo.samples = VK_SAMPLE_COUNT_1_BIT; //No multisampling
-		imageInfo.flags = 0; //No flags for now - optional
+		recordLayoutTransition(commandBuffer, texImage, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, texLayerCount, texMipLevels); //transition from undef to transfer dest optimal
 
-		if (vkCreateImage(device, &imageInfo, nullptr, &image) != VK_SUCCESS) //crash if we don't create an image
-			throw std::runtime_error("Failed to create image");
+		VkClearColorValue clearColor = {}; //atlas gutters, unused space and not yet streamed mips read as transparent black
+		VkImageSubresourceRange clearRange = {};
+		clearRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		clearRange.baseMipLevel = 0;
+		clearRange.levelCount = texMipLevels;
+		clearRange.baseArrayLayer = 0;
+		clearRange.layerCount = texLayerCount;
+		vkCmdClearColorImage(commandBuffer, texImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &clearColor, 1, &clearRange);
 
-		VkMemoryRequirements memReqs;
-		vkGetImageMemoryRequirements(device, image, &memReqs); //query our texture image for its memory requirements
+		VkMemoryBarrier clearBarrier = {}; //the copies below write over the cleared texels, order them after the clear
+		clearBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+		clearBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		clearBarrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &clearBarrier, 0, nullptr, 0, nullptr);
 
-		VkMemoryAllocateInfo allocInfo = {};
-		allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-		allocInfo.allocationSize = memReqs.size; //set the ammount of memory to allocate to the ammount we need
-		allocInfo.memoryTypeIndex = findMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT); //find memory with the properties we need, ensure it's device local
+		textureDetails.assign(textures.size(), TextureDetail());
 
-		if (vkAllocateMemory(device, &allocInfo, nullptr, &imageMemory) != VK_SUCCESS) //crash if we dont get our memory
-			throw std::runtime_error("Failed to allocate image memory");
+		for (size_t t = 0; t < textures.size(); t++) {
+			const PackedTexture &texture = textures[t];
+			std::ifstream file(texture.mipPath, std::ios::binary);
 
-		vkBindImageMemory(device, image, imageMemory, 0); //bind our image to the allocated memory
-	}
+			DetailImage detail; //streamed textures start with just the tail's top level, so sampling finer than the atlas blends into it
+			if (texture.tailMip > 0) {
+				detail = createDetailImage(texture, texture.tailMip);
+				recordLayoutTransition(commandBuffer, detail.image, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1);
+			}
 
+			for (uint32_t mip = texture.tailMip; mip < texture.mipCount; mip++) {
+				VkDeviceSize levelSize = mipLevelSize(texture, mip);
 
-	void loadModel(const std::string fileName) {
-		tinyobj::attrib_t attrib;
-		std::vector<tinyobj::shape_t> shapes;
-		std::vector<tinyobj::material_t> materials;
-		std::string err;
+				if (!stagingHasRoom(levelSize)) { //ring is full, send what we have - the next read overlaps with the copies once the oldest batch retires
+					flushUploadBatch();
+					commandBuffer = batchCommands();
+				}
 
-		if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &err, (MODEL_PATH_ROOT + fileName).c_str())) //super slow. TODO: Write threaded file loader for large models
-			throw std::runtime_error(err);
+				VkDeviceSize offset = acquireStagingRegion(levelSize); //waits for the oldest batch if the ring is still full
 
-		std::unordered_map<Vertex, uint32_t> uniqueVerticies = {};
-		int i = 0;
+				if (!readMipLevel(file, texture, mip, stagingMapped + offset)) //the level goes from disk straight into mapped staging memory
+					throw std::runtime_error("Failed to read mip file " + texture.mipPath);
 
-		for (const auto &shape : shapes) {
-			Vertex vertex[3] = {}; //stupid redefine
-			for (const auto &index : shape.mesh.indices) {
+				recordMipCopy(commandBuffer, stagingBuffer, offset, texture, mip);
 
-				vertex[i].pos = {
+				if (detail.image != VK_NULL_HANDLE && mip == texture.tailMip)
+					recordDetailCopy(commandBuffer, stagingBuffer, offset, texture, detail, mip);
+			}
+
+			if (detail.image != VK_NULL_HANDLE)
+				recordLayoutTransition(commandBuffer, detail.image, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_GENERAL, 1);
+
+			textureDetails[t].newest = detail;
+			textureDetails[t].bound = detail; //the load batch goes out before the first frame
+		}
+
+		recordLayoutTransition(commandBuffer, texImage, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, texLayerCount, texMipLevels); //change from tranfer layout to shader read layout
+
+		//stays open for the vertex, index and material uploads - frames are submitted after it on the same queue and the final transition orders them after the copies
+
+		materials.assign(MAX_MATERIALS, Material()); //unused slots sample the whole of layer 0
+
+		for (const auto &texture : textures) {
+			VkExtent2D tail = tailExtent(texture);
+			materials[texture.material].uvTransform = glm::vec4(
+				tail.width / (float)texLayerWidth, tail.height / (float)texLayerHeight,
+				texture.x / (float)texLayerWidth, texture.y / (float)texLayerHeight);
+			materials[texture.material].layer = texture.layer;
+			materials[texture.material].tailLod = static_cast<float>(texture.tailMip);
+			materials[texture.material].maxLod = static_cast<float>(texture.alignMip - texture.tailMip);
+		}
+
+		for (size_t t = 0; t < fileNames.size(); t++)
+			materials[t].virtualTexture = virtualIds[t];
+
+		packedTextures = textures;
+
+#ifndef NDEBUG
+		std::cout << "Finished loading " << textures.size() << " textures into " << texLayerCount << " layers of " << texLayerWidth << "x" << texLayerHeight << ", " << virtualTextures.size() << " virtual." << std::endl;
+#endif
+
+		bool streams = false;
+		for (const auto &texture : packedTextures)
+			streams |= texture.tailMip > 0;
+
+		if (!streams) //everything fits in its tail, nothing to stream
+			return;
+
+		if (const char *budget = std::getenv("TEXTURE_BUDGET_MB")) //lets the budget be tuned without a rebuild
+			textureBudget = static_cast<VkDeviceSize>(std::strtoull(budget, nullptr, 10)) * 1024 * 1024;
+
+		mipLoader = std::thread(&TriangleBasicsApp::mipStreamLoader, this);
+	}
+
+	uint32_t packTextures(std::vector<PackedTexture> &textures, uint32_t &layerWidth, uint32_t &layerHeight) {
+		//packs tails, not whole textures - layers are as big as the largest tail, tails that size get a layer each, everything else is shelf packed into shared atlas layers
+		if (textures.empty()) { //everything is virtual, keep one texel so the array binding stays valid
+			layerWidth = 1;
+			layerHeight = 1;
+			return 1;
+		}
+
+		layerWidth = 0;
+		layerHeight = 0;
+		for (const auto &texture : textures) {
+			layerWidth = std::max(layerWidth, tailExtent(texture).width);
+			layerHeight = std::max(layerHeight, tailExtent(texture).height);
+		}
+
+		VkPhysicalDeviceProperties props;
+		vkGetPhysicalDeviceProperties(physicalDevice, &props);
+
+		if (layerWidth > props.limits.maxImageDimension2D || layerHeight > props.limits.maxImageDimension2D)
+			throw std::runtime_error("Texture tail is larger than the device's max image size");
+
+		uint32_t layerCount = 0;
+		std::vector<PackedTexture *> atlased;
+
+		for (auto &texture : textures) {
+			if (tailExtent(texture).width == layerWidth && tailExtent(texture).height == layerHeight) {
+				texture.layer = layerCount++;
+				texture.x = 0;
+				texture.y = 0;
+				texture.alignMip = texture.mipCount - 1; //no neighbours, every mip can be sampled
+			} else {
+				atlased.push_back(&texture);
+			}
+		}
+
+		std::sort(atlased.begin(), atlased.end(), [](const PackedTexture *a, const PackedTexture *b) { return tailExtent(*a).height > tailExtent(*b).height; }); //tallest first keeps the shelves tight
+
+		uint32_t shelfAlign = 1; //shelves start where every texture on them is aligned
+		for (auto *texture : atlased)
+			shelfAlign = std::max(shelfAlign, 1u << (texture->alignMip - texture->tailMip));
+
+		uint32_t x = 0, y = 0, shelfHeight = 0;
+		bool layerOpen = false;
+
+		for (auto *texture : atlased) {
+			VkExtent2D tail = tailExtent(*texture);
+			uint32_t alignLevels = texture->alignMip - texture->tailMip; //atlas levels, level 0 is the tail
+			uint32_t align = 1u << alignLevels; //offsets stay exact at every mip down to alignMip
+			x = (x + align - 1) & ~(align - 1);
+
+			if (layerOpen && x + tail.width > layerWidth) { //row is full, start a new shelf under it
+				x = 0;
+				y = (y + shelfHeight + shelfAlign - 1) & ~(shelfAlign - 1);
+				shelfHeight = 0;
+			}
+
+			if (!layerOpen || y + tail.height > layerHeight) { //layer is full, start a new atlas layer
+				layerCount++;
+				x = 0;
+				y = 0;
+				shelfHeight = 0;
+				layerOpen = true;
+			}
+
+			texture->layer = layerCount - 1;
+			texture->x = x;
+			texture->y = y;
+
+			uint32_t padding = ATLAS_PADDING << alignLevels; //halves with every mip, still ATLAS_PADDING at alignMip
+			x += tail.width + padding;
+			shelfHeight = std::max(shelfHeight, tail.height + padding);
+		}
+
+		if (layerCount > props.limits.maxImageArrayLayers)
+			throw std::runtime_error("Too many texture layers for the device");
+
+		return layerCount;
+	}
+
+	static uint32_t mipChainLength(uint32_t size) { //levels down to and including 1x1
+		uint32_t levels = 1;
+		while (size > 1) {
+			size >>= 1;
+			levels++;
+		}
+		return levels;
+	}
+
+	static VkDeviceSize mipLevelSize(const PackedTexture &texture, uint32_t mip) {
+		return static_cast<VkDeviceSize>(std::max(1u, texture.width >> mip)) * std::max(1u, texture.height >> mip) * 4;
+	}
+
+	static VkExtent2D tailExtent(const PackedTexture &texture) { //size of the texture at atlas level 0
+		return { std::max(1u, texture.width >> texture.tailMip), std::max(1u, texture.height >> texture.tailMip) };
+	}
+
+	bool mipFileMatches(const PackedTexture &texture, const SourceStamp &source) {
+		std::ifstream file(texture.mipPath, std::ios::binary);
+		MipFileHeader header;
+
+		if (!file.read(reinterpret_cast<char *>(&header), sizeof(header)))
+			return false;
+
+		return header.magic == MIP_FILE_MAGIC && header.width == texture.width && header.height == texture.height && header.mipCount == texture.mipCount
+			&& header.source.size == source.size && header.source.modified == source.modified; //an edit that keeps the size still changes the texels
+	}
+
+	void buildMipFile(const PackedTexture &texture) {
+		//decode once and store every level back to back so any one of them can be read without touching the others
+		int texWidth, texHeight, texChannels;
+		stbi_uc *pixels = stbi_load((TEXTURE_PATH_ROOT + texture.fileName).c_str(), &texWidth, &texHeight, &texChannels, STBI_rgb_alpha);
+
+		if (!pixels)
+			throw std::runtime_error("Failed to load texture image " + texture.fileName);
+
+		std::ofstream file(texture.mipPath, std::ios::binary | std::ios::trunc);
+
+		if (!file.is_open()) {
+			stbi_image_free(pixels);
+			throw std::runtime_error("Failed to create mip file " + texture.mipPath);
+		}
+
+		MipFileHeader header = { MIP_FILE_MAGIC, texture.width, texture.height, texture.mipCount, sourceStamp(TEXTURE_PATH_ROOT + texture.fileName) };
+		file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+		const unsigned char *level = pixels;
+		std::vector<unsigned char> levelData;
+		uint32_t levelWidth = texture.width, levelHeight = texture.height;
+
+		for (uint32_t mip = 0; mip < texture.mipCount; mip++) {
+			file.write(reinterpret_cast<const char *>(level), static_cast<std::streamsize>(mipLevelSize(texture, mip)));
+
+			if (mip + 1 < texture.mipCount) {
+				std::vector<unsigned char> next = downsampleLevel(level, levelWidth, levelHeight);
+				levelWidth = std::max(1u, levelWidth / 2);
+				levelHeight = std::max(1u, levelHeight / 2);
+				levelData.swap(next);
+				level = levelData.data();
+			}
+		}
+
+		stbi_image_free(pixels);
+
+		if (!file)
+			throw std::runtime_error("Failed to write mip file " + texture.mipPath);
+	}
+
+	static bool readMipLevel(std::ifstream &file, const PackedTexture &texture, uint32_t mip, unsigned char *dst) {
+		VkDeviceSize offset = sizeof(MipFileHeader);
+		for (uint32_t m = 0; m < mip; m++)
+			offset += mipLevelSize(texture, m);
+
+		file.clear();
+		file.seekg(static_cast<std::streamoff>(offset));
+		file.read(reinterpret_cast<char *>(dst), static_cast<std::streamsize>(mipLevelSize(texture, mip)));
+
+		return file.good();
+	}
+
+	void recordMipCopy(VkCommandBuffer commandBuffer, VkBuffer srcBuffer, VkDeviceSize srcOffset, const PackedTexture &texture, uint32_t mip) { //a tail level into the atlas
+		uint32_t level = mip - texture.tailMip; //atlas level 0 is the tail
+		uint32_t levelWidth = std::max(1u, texture.width >> mip), levelHeight = std::max(1u, texture.height >> mip);
+		uint32_t layerWidth = std::max(1u, texLayerWidth >> level), layerHeight = std::max(1u, texLayerHeight >> level);
+		uint32_t x = texture.x >> level, y = texture.y >> level; //atlas rects shrink with the layer
+
+		if (x >= layerWidth || y >= layerHeight)
+			return;
+
+		VkBufferImageCopy region = {};
+		region.bufferOffset = srcOffset; //where the pixels start in the buffer
+		region.bufferRowLength = levelWidth; //rows stay levelWidth apart even if the copy gets clipped
+		region.bufferImageHeight = levelHeight;
+
+		region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT; //the aspect of the buffer to copy
+		region.imageSubresource.mipLevel = level;
+		region.imageSubresource.baseArrayLayer = texture.layer; //the layer the packer picked
+		region.imageSubresource.layerCount = 1;
+
+		region.imageOffset = { static_cast<int32_t>(x), static_cast<int32_t>(y), 0 }; //atlas position inside the layer
+		region.imageExtent = { std::min(levelWidth, layerWidth - x), std::min(levelHeight, layerHeight - y), 1 }; //rounding can push a tiny level a texel past the layer edge
+
+		vkCmdCopyBufferToImage(commandBuffer, srcBuffer, texImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+	}
+
+	DetailImage createDetailImage(const PackedTexture &texture, uint32_t baseMip) { //levels baseMip down to the tail, contents undefined
+		DetailImage detail;
+		detail.baseMip = baseMip;
+
+		createImage(std::max(1u, texture.width >> baseMip), std::max(1u, texture.height >> baseMip), VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_TILING_OPTIMAL,
+			VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, detail.image, detail.memory, 1, detailLevels(texture, detail));
+
+		VkImageSubresourceRange subresourceRange = {};
+		subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		subresourceRange.baseMipLevel = 0;
+		subresourceRange.levelCount = detailLevels(texture, detail);
+		subresourceRange.baseArrayLayer = 0;
+		subresourceRange.layerCount = 1;
+
+		ovgfCreateImageView(detail.image, VK_IMAGE_VIEW_TYPE_2D, VK_FORMAT_R8G8B8A8_UNORM, { VK_COMPONENT_SWIZZLE_IDENTITY }, subresourceRange, &detail.view);
+		return detail;
+	}
+
+	static uint32_t detailLevels(const PackedTexture &texture, const DetailImage &detail) {
+		return texture.tailMip - detail.baseMip + 1;
+	}
+
+	void recordDetailCopy(VkCommandBuffer commandBuffer, VkBuffer srcBuffer, VkDeviceSize srcOffset, const PackedTexture &texture, const DetailImage &detail, uint32_t mip) {
+		VkBufferImageCopy region = {};
+		region.bufferOffset = srcOffset;
+		region.bufferRowLength = 0; //tightly packed, same as the mip file
+		region.bufferImageHeight = 0;
+		region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		region.imageSubresource.mipLevel = mip - detail.baseMip;
+		region.imageSubresource.baseArrayLayer = 0;
+		region.imageSubresource.layerCount = 1;
+		region.imageOffset = { 0, 0, 0 };
+		region.imageExtent = { std::max(1u, texture.width >> mip), std::max(1u, texture.height >> mip), 1 };
+
+		vkCmdCopyBufferToImage(commandBuffer, srcBuffer, detail.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+	}
+
+	void rebuildDetailImage(VkCommandBuffer commandBuffer, uint32_t t, uint32_t baseMip, std::vector<DetailImage> &superseded) {
+		//a new image from baseMip down to the tail, the levels it shares with the old one copied across on the GPU - left in TRANSFER_DST for the caller to finish
+		//detail images live in GENERAL once filled, so the old one can be copied out of while frames in flight still sample it, with no layout change racing them
+		const PackedTexture &texture = packedTextures[t];
+		TextureDetail &detail = textureDetails[t];
+		DetailImage old = detail.newest;
+		DetailImage rebuilt = createDetailImage(texture, baseMip);
+
+		recordLayoutTransition(commandBuffer, rebuilt.image, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, detailLevels(texture, rebuilt));
+
+		std::vector<VkImageCopy> regions;
+		for (uint32_t mip = std::max(baseMip, old.baseMip); mip <= texture.tailMip; mip++) {
+			VkImageCopy region = {};
+			region.srcSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, mip - old.baseMip, 0, 1 };
+			region.dstSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, mip - baseMip, 0, 1 };
+			region.srcOffset = { 0, 0, 0 };
+			region.dstOffset = { 0, 0, 0 };
+			region.extent = { std::max(1u, texture.width >> mip), std::max(1u, texture.height >> mip), 1 };
+			regions.push_back(region);
+		}
+
+		vkCmdCopyImage(commandBuffer, old.image, VK_IMAGE_LAYOUT_GENERAL, rebuilt.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, static_cast<uint32_t>(regions.size()), regions.data());
+
+		if (old.image != detail.bound.image) //never bound, nothing but this copy reads it
+			superseded.push_back(old);
+
+		detail.newest = rebuilt;
+	}
+
+	void retireDetailImage(const DetailImage &detail, GpuTimepoint after) {
+		deferDestroyImageView(detail.view, after);
+		deferDestroyImage(detail.image, detail.memory, after);
+	}
+
+	bool uploadSubmitted(UploadToken token) const { //on the graphics queue, so anything submitted after it sees what it wrote
+		return uploadsPending.empty() || token < uploadsPending.front().token;
+	}
+
+	void bindDetailImages() { //moves the descriptor set onto detail images whose uploads have reached the graphics queue, frames before that keep sampling the old ones
+		std::vector<uint32_t> ready;
+		for (uint32_t t = 0; t < textureDetails.size(); t++)
+			if (textureDetails[t].newest.image != textureDetails[t].bound.image && uploadSubmitted(textureDetails[t].newest.filled))
+				ready.push_back(t);
+
+		if (ready.empty())
+			return;
+
+		VkDescriptorSet fresh;
+		if (!allocateDescriptorSet(fresh))
+			return; //every spare set is still held by frames in flight, try again next frame
+
+		GpuTimepoint inUse = gpuNow(); //frames bound the old images, and the uploads that copied out of them are submitted
+		for (uint32_t t : ready) {
+			retireDetailImage(textureDetails[t].bound, inUse);
+			textureDetails[t].bound = textureDetails[t].newest;
+		}
+
+		swapDescriptorSet(fresh);
+	}
+
+	void createDetailFallback() { //1x1 transparent black, fills the detail slots of materials that don't stream
+		createImage(1, 1, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, detailFallbackImage, detailFallbackMem);
+
+		VkCommandBuffer commandBuffer = batchCommands();
+		recordLayoutTransition(commandBuffer, detailFallbackImage, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1);
+
+		VkClearColorValue clearColor = {};
+		VkImageSubresourceRange subresourceRange = {};
+		subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		subresourceRange.baseMipLevel = 0;
+		subresourceRange.levelCount = 1;
+		subresourceRange.baseArrayLayer = 0;
+		subresourceRange.layerCount = 1;
+		vkCmdClearColorImage(commandBuffer, detailFallbackImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &clearColor, 1, &subresourceRange);
+
+		recordLayoutTransition(commandBuffer, detailFallbackImage, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, 1);
+
+		ovgfCreateImageView(detailFallbackImage, VK_IMAGE_VIEW_TYPE_2D, VK_FORMAT_R8G8B8A8_UNORM, { VK_COMPONENT_SWIZZLE_IDENTITY }, subresourceRange, &detailFallbackView);
+	}
+
+	uint32_t desiredMip(const PackedTexture &texture) {
+		//texels per pixel of the texture's geometry at its closest point to the camera, from this frame's matrices
+		const MaterialBounds &bounds = materialBounds[texture.material];
+
+		if (bounds.uvArea <= 0.0 || bounds.worldArea <= 0.0) //nothing draws with it
+			return texture.tailMip;
+
+		glm::vec3 center = (bounds.min + bounds.max) * 0.5f;
+		float radius = glm::length(bounds.max - bounds.min) * 0.5f;
+		glm::vec4 viewPos = frameModelView * glm::vec4(center, 1.0f);
+
+		if (viewPos.z - radius > 0.0f) //entirely behind the camera
+			return texture.tailMip;
+
+		float distance = std::max(-viewPos.z - radius, 0.1f); //clamp to the near plane
+		float pixelsPerUnit = std::abs(frameProjection[1][1]) * 0.5f * swapChainExtent.height / distance;
+		float unitsPerUv = static_cast<float>(std::sqrt(bounds.worldArea / bounds.uvArea)); //average world size of one uv repeat
+		float texelsPerPixel = std::max(texture.width, texture.height) / (unitsPerUv * pixelsPerUnit);
+
+		uint32_t mip = texelsPerPixel > 1.0f ? static_cast<uint32_t>(std::log2(texelsPerPixel)) : 0;
+		return std::min(mip, texture.tailMip);
+	}
+
+	void updateTextureStreaming() {
+		if (!mipLoader.joinable())
+			return;
+
+		streamFrame++;
+
+		std::vector<uint32_t> wanted;
+
+		for (uint32_t t = 0; t < packedTextures.size(); t++) {
+			PackedTexture &texture = packedTextures[t];
+			uint32_t mip = desiredMip(texture);
+
+			for (uint32_t m = mip; m < texture.tailMip; m++)
+				texture.lastNeeded[m] = streamFrame;
+
+			if (mip < texture.residentMip) //one level at a time, each finer level only helps once the coarser one is in
+				wanted.push_back((t << 8) | (texture.residentMip - 1));
+		}
+
+		std::unordered_set<uint32_t> ready; //already loaded, just waiting for budget
+		for (const auto &level : mipReady)
+			ready.insert(level.key);
+
+		{
+			std::lock_guard<std::mutex> lock(mipMutex);
+
+			for (uint32_t key : mipRequests) //drop requests the view has moved away from
+				mipPending.erase(key);
+			mipRequests.clear();
+
+			for (uint32_t key : wanted)
+				if (!ready.count(key) && mipPending.insert(key).second)
+					mipRequests.push_back(key);
+
+			for (auto &level : mipLoaded) {
+				mipPending.erase(level.key);
+				mipReady.push_back(std::move(level));
+			}
+			mipLoaded.clear();
+		}
+
+		mipWake.notify_one(); //uploads go out through scheduleUploads
+	}
+
+	bool makeStreamingRoom(VkCommandBuffer commandBuffer, uint32_t streaming, VkDeviceSize size, std::vector<uint32_t> &rebuilt, std::vector<DetailImage> &superseded) {
+		//drop the finest level of whichever texture has gone longest without needing it until size fits the budget - its detail image is rebuilt without the level, so the memory really goes
+		while (streamedBytes + size > textureBudget) {
+			uint32_t victim = static_cast<uint32_t>(packedTextures.size());
+
+			for (uint32_t t = 0; t < packedTextures.size(); t++) {
+				const PackedTexture &texture = packedTextures[t];
+				if (t == streaming || texture.residentMip >= texture.tailMip || texture.lastNeeded[texture.residentMip] == streamFrame) //tails never go, and neither does anything on screen
+					continue;
+
+				if (victim == packedTextures.size() || texture.lastNeeded[texture.residentMip] < packedTextures[victim].lastNeeded[packedTextures[victim].residentMip])
+					victim = t;
+			}
+
+			if (victim == packedTextures.size())
+				return false;
+
+			PackedTexture &texture = packedTextures[victim];
+			streamedBytes -= mipLevelSize(texture, texture.residentMip);
+			texture.residentMip++;
+
+			rebuildDetailImage(commandBuffer, victim, texture.residentMip, superseded);
+			recordLayoutTransition(commandBuffer, textureDetails[victim].newest.image, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_GENERAL, 1, detailLevels(texture, textureDetails[victim].newest));
+			rebuilt.push_back(victim);
+		}
+
+		return true;
+	}
+
+	UploadTally uploadStreamedMips(std::vector<LoadedMip> &levels) { //leaves in levels whatever didn't fit, for the caller to keep
+		UploadTally tally;
+		if (levels.empty())
+			return tally;
+
+		VkCommandBuffer commandBuffer = beginStreamingCommands();
+		std::vector<uint32_t> rebuilt; //textures whose newest detail image this submission fills
+		std::vector<DetailImage> superseded; //replaced before they were ever bound
+
+		size_t consumed = 0;
+		for (; consumed < levels.size(); consumed++) {
+			const LoadedMip &level = levels[consumed];
+			uint32_t t = level.key >> 8;
+			PackedTexture &texture = packedTextures[t];
+			uint32_t mip = level.key & 0xFF;
+
+			if (level.texels.empty() || mip + 1 != texture.residentMip) //failed read, or an eviction moved residency since it was asked for
+				continue;
+
+			VkDeviceSize levelSize = level.texels.size();
+			bool viaStaging = levelSize <= STAGING_BUFFER_SIZE / 2;
+
+			if (viaStaging && !stagingHasRoom(levelSize + stagingAlignment))
+				break; //the rest stays ready for next frame
+
+			if (!makeStreamingRoom(commandBuffer, t, levelSize, rebuilt, superseded))
+				break; //everything resident is still on screen
+
+			VkBuffer srcBuffer = stagingSource();
+			VkDeviceSize srcOffset = 0;
+
+			if (viaStaging) {
+				srcOffset = acquireStagingRegion(levelSize);
+				memcpy(stagingMapped + srcOffset, level.texels.data(), static_cast<size_t>(levelSize));
+			} else {
+				MemoryAllocation tempBuffMem;
+				stageInTempBuffer(level.texels.data(), levelSize, srcBuffer, tempBuffMem);
+				releaseAfterUpload(srcBuffer, tempBuffMem);
+			}
+
+			rebuildDetailImage(commandBuffer, t, mip, superseded);
+			const DetailImage &detail = textureDetails[t].newest;
+			recordDetailCopy(commandBuffer, srcBuffer, srcOffset, texture, detail, mip);
+			recordLayoutTransition(commandBuffer, detail.image, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_GENERAL, 1, detailLevels(texture, detail));
+			rebuilt.push_back(t);
+
+			texture.residentMip = mip;
+			streamedBytes += levelSize;
+
+			tally.bytes += levelSize;
+			tally.copies++;
+		}
+
+		levels.erase(levels.begin(), levels.begin() + consumed);
+
+		UploadToken token = submitUploads(commandBuffer); //no wait, the ring and temp buffers are recycled once the fence signals
+
+		for (uint32_t t : rebuilt)
+			textureDetails[t].newest.filled = token; //bindDetailImages swaps it in once this submission is on the graphics queue
+
+		GpuTimepoint copied = gpuNow();
+		for (const auto &detail : superseded)
+			retireDetailImage(detail, copied);
+
+		return tally;
+	}
+
+	void mipStreamLoader() { //runs on mipLoader - only reads the mip files and the queues guarded by mipMutex
+		std::vector<std::ifstream> files;
+		for (const auto &texture : packedTextures)
+			files.emplace_back(texture.mipPath, std::ios::binary);
+
+		for (;;) {
+			LoadedMip level;
+
+			{
+				std::unique_lock<std::mutex> lock(mipMutex);
+				mipWake.wait(lock, [this] { return mipStopLoader || !mipRequests.empty(); });
+
+				if (mipStopLoader)
+					return;
+
+				level.key = mipRequests.front();
+				mipRequests.pop_front();
+			}
+
+			const PackedTexture &texture = packedTextures[level.key >> 8]; //file name and size never change once streaming starts
+			uint32_t mip = level.key & 0xFF;
+			level.texels.resize(static_cast<size_t>(mipLevelSize(texture, mip)));
+
+			if (!readMipLevel(files[level.key >> 8], texture, mip, level.texels.data()))
+				level.texels.clear(); //dropped on the render thread, asked for again if it's still needed
+
+			std::lock_guard<std::mutex> lock(mipMutex);
+			mipLoaded.push_back(std::move(level));
+		}
+	}
+
+	void stopMipStreamLoader() {
+		if (!mipLoader.joinable())
+			return;
+
+		{
+			std::lock_guard<std::mutex> lock(mipMutex);
+			mipStopLoader = true;
+		}
+
+		mipWake.notify_one();
+		mipLoader.join();
+	}
+
+	void stageInTempBuffer(const void *data, VkDeviceSize size, VkBuffer &buffer, MemoryAllocation &bufferMemory) {
+		//create buffer on the divice with a transfer source memory layout, the host visible and coherent flags, and the buffer/memory to fill
+		createBuffer(size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, buffer, bufferMemory);
+
+		memcpy(bufferMemory.mapped, data, static_cast<size_t>(size)); //host visible allocations come back mapped
+	}
+
+	uint32_t createVirtualTexture(const std::string &fileName, uint32_t width, uint32_t height) {
+		if (virtualTextures.size() == MAX_VIRTUAL_TEXTURES)
+			throw std::runtime_error("Too many virtual textures");
+
+		VirtualTexture vt;
+		vt.pagePath = TEXTURE_PATH_ROOT + fileName + ".vtpages";
+		vt.width = width;
+		vt.height = height;
+
+		uint64_t pageCount = 0;
+		for (uint32_t mip = 0; ; mip++) { //halve until one page covers the whole texture
+			uint32_t span = VT_PAGE_CONTENT << mip; //source texels a page spans at this mip
+			vt.firstPage.push_back(pageCount);
+			vt.pagesX.push_back((width + span - 1) / span);
+			vt.pagesY.push_back((height + span - 1) / span);
+			pageCount += static_cast<uint64_t>(vt.pagesX.back()) * vt.pagesY.back();
+
+			if (vt.pagesX.back() == 1 && vt.pagesY.back() == 1)
+				break;
+		}
+		vt.mipCount = static_cast<uint32_t>(vt.pagesX.size());
+
+		if (vt.pagesX[0] > VT_MAX_PAGES_PER_SIDE || vt.pagesY[0] > VT_MAX_PAGES_PER_SIDE)
+			throw std::runtime_error("Texture is too large to stream " + fileName);
+
+		if (!pageFileMatches(vt, sourceStamp(TEXTURE_PATH_ROOT + fileName))) //first run, or the source changed since it was tiled
+			buildPageFile(fileName, vt);
+
+		virtualTextures.push_back(vt);
+		return static_cast<uint32_t>(virtualTextures.size() - 1);
+	}
+
+	bool pageFileMatches(const VirtualTexture &vt, const SourceStamp &source) {
+		std::ifstream file(vt.pagePath, std::ios::binary);
+		VirtualTextureHeader header;
+
+		if (!file.read(reinterpret_cast<char *>(&header), sizeof(header)))
+			return false;
+
+		return header.magic == VT_FILE_MAGIC && header.width == vt.width && header.height == vt.height && header.mipCount == vt.mipCount
+			&& header.pageContent == VT_PAGE_CONTENT && header.pageBorder == VT_PAGE_BORDER
+			&& header.source.size == source.size && header.source.modified == source.modified; //same dimensions say nothing about the texels
+	}
+
+	void buildPageFile(const std::string &fileName, const VirtualTexture &vt) {
+		//decode once, box filter the mips on the cpu and write every page with its borders already filled in
+		int texWidth, texHeight, texChannels;
+		stbi_uc *pixels = stbi_load((TEXTURE_PATH_ROOT + fileName).c_str(), &texWidth, &texHeight, &texChannels, STBI_rgb_alpha);
+
+		if (!pixels)
+			throw std::runtime_error("Failed to load texture image " + fileName);
+
+		std::ofstream file(vt.pagePath, std::ios::binary | std::ios::trunc);
+
+		if (!file.is_open()) {
+			stbi_image_free(pixels);
+			throw std::runtime_error("Failed to create page file " + vt.pagePath);
+		}
+
+		VirtualTextureHeader header = { VT_FILE_MAGIC, vt.width, vt.height, vt.mipCount, VT_PAGE_CONTENT, VT_PAGE_BORDER, sourceStamp(TEXTURE_PATH_ROOT + fileName) };
+		file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+		const unsigned char *level = pixels; //mip 0 reads straight from the decoded image
+		std::vector<unsigned char> levelData;
+		uint32_t levelWidth = vt.width, levelHeight = vt.height;
+		std::vector<unsigned char> page(static_cast<size_t>(VT_PAGE_BYTES));
+
+		for (uint32_t mip = 0; mip < vt.mipCount; mip++) {
+			for (uint32_t py = 0; py < vt.pagesY[mip]; py++) {
+				for (uint32_t px = 0; px < vt.pagesX[mip]; px++) {
+					for (uint32_t y = 0; y < VT_PAGE_SIZE; y++) {
+						uint32_t srcY = wrapTexel(static_cast<int64_t>(py) * VT_PAGE_CONTENT + y - VT_PAGE_BORDER, levelHeight); //borders wrap like the repeat sampler would
+
+						for (uint32_t x = 0; x < VT_PAGE_SIZE; x++) {
+							uint32_t srcX = wrapTexel(static_cast<int64_t>(px) * VT_PAGE_CONTENT + x - VT_PAGE_BORDER, levelWidth);
+							memcpy(&page[(static_cast<size_t>(y) * VT_PAGE_SIZE + x) * 4], &level[(static_cast<size_t>(srcY) * levelWidth + srcX) * 4], 4);
+						}
+					}
+
+					file.write(reinterpret_cast<const char *>(page.data()), page.size());
+				}
+			}
+
+			if (mip + 1 < vt.mipCount) {
+				std::vector<unsigned char> next = downsampleLevel(level, levelWidth, levelHeight);
+				levelWidth = std::max(1u, levelWidth / 2);
+				levelHeight = std::max(1u, levelHeight / 2);
+				levelData.swap(next);
+				level = levelData.data();
+			}
+		}
+
+		stbi_image_free(pixels);
+
+		if (!file)
+			throw std::runtime_error("Failed to write page file " + vt.pagePath);
+	}
+
+	static uint32_t wrapTexel(int64_t coord, uint32_t size) {
+		return static_cast<uint32_t>(((coord % size) + size) % size);
+	}
+
+	static std::vector<unsigned char> downsampleLevel(const unsigned char *src, uint32_t width, uint32_t height) { //2x2 box filter, odd edges repeat the last texel
+		uint32_t outWidth = std::max(1u, width / 2), outHeight = std::max(1u, height / 2);
+		std::vector<unsigned char> dst(static_cast<size_t>(outWidth) * outHeight * 4);
+
+		for (uint32_t y = 0; y < outHeight; y++) {
+			uint32_t y0 = std::min(2 * y, height - 1), y1 = std::min(2 * y + 1, height - 1);
+
+			for (uint32_t x = 0; x < outWidth; x++) {
+				uint32_t x0 = std::min(2 * x, width - 1), x1 = std::min(2 * x + 1, width - 1);
+
+				for (uint32_t c = 0; c < 4; c++) {
+					uint32_t sum = src[(static_cast<size_t>(y0) * width + x0) * 4 + c] + src[(static_cast<size_t>(y0) * width + x1) * 4 + c]
+						+ src[(static_cast<size_t>(y1) * width + x0) * 4 + c] + src[(static_cast<size_t>(y1) * width + x1) * 4 + c];
+					dst[(static_cast<size_t>(y) * outWidth + x) * 4 + c] = static_cast<unsigned char>((sum + 2) / 4);
+				}
+			}
+		}
+
+		return dst;
+	}
+
+	bool readVirtualPage(std::ifstream &file, uint32_t key, std::vector<unsigned char> &texels) const {
+		const VirtualTexture &vt = virtualTextures[pageKeyTexture(key)];
+		uint32_t mip = pageKeyMip(key);
+		uint64_t page = vt.firstPage[mip] + static_cast<uint64_t>(pageKeyY(key)) * vt.pagesX[mip] + pageKeyX(key);
+
+		texels.resize(static_cast<size_t>(VT_PAGE_BYTES));
+		file.clear();
+		file.seekg(static_cast<std::streamoff>(sizeof(VirtualTextureHeader) + page * VT_PAGE_BYTES));
+		file.read(reinterpret_cast<char *>(texels.data()), texels.size());
+
+		return file.good();
+	}
+
+	void createVirtualTextureResources() {
+		//created even with nothing virtual so the descriptor set is always complete
+		std::vector<VirtualTextureInfo> infos(MAX_VIRTUAL_TEXTURES);
+		uint32_t maxPages = 1;
+		vtIndirectionMips = 1;
+
+		for (size_t v = 0; v < virtualTextures.size(); v++) {
+			const VirtualTexture &vt = virtualTextures[v];
+			infos[v].size = glm::vec4(static_cast<float>(vt.width), static_cast<float>(vt.height), static_cast<float>(vt.mipCount), 0.0f);
+			maxPages = std::max(maxPages, std::max(vt.pagesX[0], vt.pagesY[0]));
+			vtIndirectionMips = std::max(vtIndirectionMips, vt.mipCount);
+		}
+
+		createStagedBuffer(sizeof(VirtualTextureInfo) * MAX_VIRTUAL_TEXTURES, infos.data(), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, 0, vtInfoBuffer, vtInfoBufferMemory);
+
+		vtIndirectionSize = 1;
+		while (vtIndirectionSize < maxPages)
+			vtIndirectionSize <<= 1;
+
+		uint32_t indirectionLayers = std::max(1u, static_cast<uint32_t>(virtualTextures.size()));
+		uint32_t cacheSize = virtualTextures.empty() ? 1 : VT_CACHE_PAGES * VT_PAGE_SIZE;
+
+		createImage(cacheSize, cacheSize, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, vtCacheImage, vtCacheImageMem);
+		createImage(vtIndirectionSize, vtIndirectionSize, VK_FORMAT_R32_UINT, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, vtIndirectionImage, vtIndirectionImageMem, indirectionLayers, vtIndirectionMips);
+
+		VkImageSubresourceRange cacheRange = {};
+		cacheRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		cacheRange.baseMipLevel = 0;
+		cacheRange.levelCount = 1;
+		cacheRange.baseArrayLayer = 0;
+		cacheRange.layerCount = 1;
+
+		VkImageSubresourceRange indirectionRange = cacheRange;
+		indirectionRange.levelCount = vtIndirectionMips;
+		indirectionRange.layerCount = indirectionLayers;
+
+		ovgfCreateImageView(vtCacheImage, VK_IMAGE_VIEW_TYPE_2D, VK_FORMAT_R8G8B8A8_UNORM, { VK_COMPONENT_SWIZZLE_IDENTITY }, cacheRange, &vtCacheImgView);
+		ovgfCreateImageView(vtIndirectionImage, VK_IMAGE_VIEW_TYPE_2D_ARRAY, VK_FORMAT_R32_UINT, { VK_COMPONENT_SWIZZLE_IDENTITY }, indirectionRange, &vtIndirectionImgView);
+
+		VkCommandBuffer commandBuffer = batchCommands(); //start both out cleared so nothing samples undefined texels
+
+		recordLayoutTransition(commandBuffer, vtCacheImage, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1);
+		recordLayoutTransition(commandBuffer, vtIndirectionImage, VK_FORMAT_R32_UINT, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, indirectionLayers, vtIndirectionMips);
+
+		VkClearColorValue clearColor = {};
+		vkCmdClearColorImage(commandBuffer, vtCacheImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &clearColor, 1, &cacheRange);
+		vkCmdClearColorImage(commandBuffer, vtIndirectionImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &clearColor, 1, &indirectionRange);
+
+		recordLayoutTransition(commandBuffer, vtCacheImage, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, 1);
+		recordLayoutTransition(commandBuffer, vtIndirectionImage, VK_FORMAT_R32_UINT, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, indirectionLayers, vtIndirectionMips);
+
+		VkSamplerCreateInfo samplerInfo = {};
+		samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+		samplerInfo.magFilter = VK_FILTER_LINEAR;
+		samplerInfo.minFilter = VK_FILTER_LINEAR;
+		samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE; //the page borders handle wrapping
+		samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+		samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+		samplerInfo.anisotropyEnable = VK_FALSE; //a wide anisotropic footprint would reach past the page border
+		samplerInfo.maxAnisotropy = 1;
+		samplerInfo.borderColor = VK_BORDER_COLOR_INT_OPAQUE_BLACK;
+		samplerInfo.unnormalizedCoordinates = VK_FALSE;
+		samplerInfo.compareEnable = VK_FALSE;
+		samplerInfo.compareOp = VK_COMPARE_OP_ALWAYS;
+		samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+		samplerInfo.mipLodBias = 0.0f;
+		samplerInfo.minLod = 0.0f;
+		samplerInfo.maxLod = 0.0f;
+
+		if (vkCreateSampler(device, &samplerInfo, nullptr, &vtCacheSampler) != VK_SUCCESS)
+			throw std::runtime_error("Failed to create page cache sampler");
+
+		samplerInfo.magFilter = VK_FILTER_NEAREST; //integer texels can't be filtered
+		samplerInfo.minFilter = VK_FILTER_NEAREST;
+		samplerInfo.maxLod = static_cast<float>(vtIndirectionMips);
+
+		if (vkCreateSampler(device, &samplerInfo, nullptr, &vtIndirectionSampler) != VK_SUCCESS)
+			throw std::runtime_error("Failed to create indirection sampler");
+
+		if (virtualTextures.empty())
+			return;
+
+		vtSlotKey.assign(VT_CACHE_PAGES * VT_CACHE_PAGES, VT_INVALID_KEY);
+		vtSlotLastUsed.assign(vtSlotKey.size(), 0);
+		vtSlotPinned.assign(vtSlotKey.size(), false);
+
+		std::vector<LoadedPage> topPages(virtualTextures.size()); //read synchronously, every lookup falls back to these
+
+		for (uint32_t v = 0; v < virtualTextures.size(); v++) {
+			std::ifstream file(virtualTextures[v].pagePath, std::ios::binary);
+			topPages[v].key = packPageKey(v, virtualTextures[v].mipCount - 1, 0, 0);
+
+			if (!readVirtualPage(file, topPages[v].key, topPages[v].texels))
+				throw std::runtime_error("Failed to read page file " + virtualTextures[v].pagePath);
+		}
+
+		std::vector<uint32_t> topKeys;
+		for (const auto &page : topPages)
+			topKeys.push_back(page.key);
+
+		uploadVirtualPages(topPages);
+
+		for (uint32_t key : topKeys) {
+			auto slot = vtResident.find(key);
+
+			if (slot == vtResident.end())
+				throw std::runtime_error("Page cache too small for the virtual texture top mips");
+
+			vtSlotPinned[slot->second] = true;
+		}
+
+		vtLoader = std::thread(&TriangleBasicsApp::virtualTextureLoader, this);
+	}
+
+	void virtualTextureLoader() { //runs on vtLoader - only reads the page files and the queues guarded by vtMutex
+		std::vector<std::ifstream> files;
+		for (const auto &vt : virtualTextures)
+			files.emplace_back(vt.pagePath, std::ios::binary);
+
+		for (;;) {
+			LoadedPage page;
+
+			{
+				std::unique_lock<std::mutex> lock(vtMutex);
+				vtWake.wait(lock, [this] { return vtStopLoader || !vtRequests.empty(); });
+
+				if (vtStopLoader)
+					return;
+
+				page.key = vtRequests.front();
+				vtRequests.pop_front();
+			}
+
+			if (!readVirtualPage(files[pageKeyTexture(page.key)], page.key, page.texels))
+				page.texels.clear(); //dropped on the render thread, asked for again if it's still visible
+
+			std::lock_guard<std::mutex> lock(vtMutex);
+			vtLoaded.push_back(std::move(page));
+		}
+	}
+
+	void stopVirtualTextureLoader() {
+		if (!vtLoader.joinable())
+			return;
+
+		{
+			std::lock_guard<std::mutex> lock(vtMutex);
+			vtStopLoader = true;
+		}
+
+		vtWake.notify_one();
+		vtLoader.join();
+	}
+
+	void updateVirtualTextures(uint32_t frameSlot) { //frameSlot's fence has just been waited on, so its feedback copy is complete
+		if (virtualTextures.empty())
+			return;
+
+		FeedbackReadback &readback = feedbackReadbacks[frameSlot];
+		bool fresh = readback.written; //false when the slot's frame skipped the pass, the last requests stand until one runs
+		readback.written = false;
+
+		if (fresh)
+			vtFrame++;
+
+		std::unordered_set<uint32_t> requested; //pages the slot's feedback pass saw, deduplicated
+		size_t feedbackTexels = fresh ? static_cast<size_t>(feedbackExtent.width) * feedbackExtent.height : 0;
+		for (size_t i = 0; i < feedbackTexels; i++)
+			if (readback.mapped[i] != VT_INVALID_KEY)
+				requested.insert(readback.mapped[i]);
+
+		std::vector<uint32_t> missing;
+		std::unordered_set<uint32_t> visited;
+
+		for (uint32_t key : requested) {
+			uint32_t v = pageKeyTexture(key), mip = pageKeyMip(key), x = pageKeyX(key), y = pageKeyY(key);
+
+			if (v >= virtualTextures.size() || mip >= virtualTextures[v].mipCount || x >= virtualTextures[v].pagesX[mip] || y >= virtualTextures[v].pagesY[mip])
+				continue; //stale readback
+
+			for (; mip < virtualTextures[v].mipCount; mip++, x /= 2, y /= 2) { //walk up to the top mip, ancestors are what a missing page falls back to
+				uint32_t chainKey = packPageKey(v, mip, x, y);
+
+				if (!visited.insert(chainKey).second)
+					break; //the rest of the chain was already handled
+
+				auto slot = vtResident.find(chainKey);
+				if (slot != vtResident.end())
+					vtSlotLastUsed[slot->second] = vtFrame;
+				else
+					missing.push_back(chainKey);
+			}
+		}
+
+		std::sort(missing.begin(), missing.end(), [](uint32_t a, uint32_t b) { return pageKeyMip(a) > pageKeyMip(b); }); //coarse pages first, they cover the most screen
+
+		if (fresh) {
+			vtWanted.clear();
+			vtWanted.insert(missing.begin(), missing.end());
+		}
+
+		std::unordered_set<uint32_t> ready; //already loaded, just waiting for budget
+		for (const auto &page : vtReady)
+			ready.insert(page.key);
+
+		{
+			std::lock_guard<std::mutex> lock(vtMutex);
+
+			if (fresh) {
+				for (uint32_t key : vtRequests) //drop requests the view has moved away from
+					vtPending.erase(key);
+				vtRequests.clear();
+
+				for (uint32_t key : missing)
+					if (!ready.count(key) && vtPending.insert(key).second)
+						vtRequests.push_back(key);
+			}
+
+			for (auto &page : vtLoaded) {
+				vtPending.erase(page.key);
+				vtReady.push_back(std::move(page));
+			}
+			vtLoaded.clear();
+		}
+
+		vtWake.notify_one(); //uploads go out through scheduleUploads
+	}
+
+	void scheduleUploads() {
+		//every loaded mip and page competes for one per frame budget, most important first - whatever doesn't fit waits for the next frame
+		mipReady.erase(std::remove_if(mipReady.begin(), mipReady.end(), [this](const LoadedMip &level) {
+			return level.texels.empty() || (level.key & 0xFF) + 1 != packedTextures[level.key >> 8].residentMip; //failed read, or residency moved since it was asked for
+		}), mipReady.end());
+		vtReady.erase(std::remove_if(vtReady.begin(), vtReady.end(), [this](const LoadedPage &page) {
+			return page.texels.empty() || vtResident.count(page.key) != 0;
+		}), vtReady.end());
+
+		std::vector<ScheduledUpload> candidates;
+
+		for (size_t i = 0; i < vtReady.size(); i++) {
+			uint32_t key = vtReady[i].key;
+			const VirtualTexture &vt = virtualTextures[pageKeyTexture(key)];
+
+			ScheduledUpload upload;
+			upload.priority = (vtWanted.count(key) ? 2.0f : 0.0f) + static_cast<float>(pageKeyMip(key) + 1) / vt.mipCount; //coarse pages cover the most screen
+			upload.bytes = VT_PAGE_BYTES;
+			upload.page = true;
+			upload.index = i;
+			candidates.push_back(upload);
+		}
+
+		for (size_t i = 0; i < mipReady.size(); i++) {
+			const PackedTexture &texture = packedTextures[mipReady[i].key >> 8];
+			uint32_t mip = mipReady[i].key & 0xFF;
+
+			uint32_t shortBy = 0; //levels the texture is missing on screen - the closer it is, the more it's missing
+			for (uint32_t m = mip + 1; m-- > 0 && texture.lastNeeded[m] == streamFrame;)
+				shortBy++;
+
+			ScheduledUpload upload;
+			upload.priority = (shortBy > 0 ? 2.0f : 0.0f) + std::min(shortBy, 4u) / 4.0f;
+			upload.bytes = mipReady[i].texels.size();
+			upload.page = false;
+			upload.index = i;
+			candidates.push_back(upload);
+		}
+
+		std::sort(candidates.begin(), candidates.end(), [](const ScheduledUpload &a, const ScheduledUpload &b) {
+			return a.priority != b.priority ? a.priority > b.priority : a.bytes < b.bytes;
+		});
+
+		VkDeviceSize bytesLeft = uploadBytesPerFrame;
+		uint32_t copiesLeft = uploadCopiesPerFrame;
+		std::vector<bool> pageTaken(vtReady.size()), mipTaken(mipReady.size());
+		std::vector<LoadedPage> pages;
+		std::vector<LoadedMip> levels;
+
+		for (const auto &upload : candidates) {
+			if (copiesLeft == 0)
+				break;
+
+			if (upload.bytes > bytesLeft && copiesLeft != uploadCopiesPerFrame)
+				continue; //something smaller might still fit - anything bigger than the whole budget goes out alone
+
+			bytesLeft -= std::min(bytesLeft, upload.bytes);
+			copiesLeft--;
+
+			if (upload.page) {
+				pages.push_back(std::move(vtReady[upload.index]));
+				pageTaken[upload.index] = true;
+			} else {
+				levels.push_back(std::move(mipReady[upload.index]));
+				mipTaken[upload.index] = true;
+			}
+		}
+
+		size_t kept = 0;
+		for (size_t i = 0; i < vtReady.size(); i++)
+			if (!pageTaken[i])
+				vtReady[kept++] = std::move(vtReady[i]);
+		vtReady.resize(kept);
+
+		kept = 0;
+		for (size_t i = 0; i < mipReady.size(); i++)
+			if (!mipTaken[i])
+				mipReady[kept++] = std::move(mipReady[i]);
+		mipReady.resize(kept);
+
+		UploadTally pageTally = uploadVirtualPages(pages);
+		UploadTally mipTally = uploadStreamedMips(levels);
+		flushIndirectionUpdates(); //normally a no-op, the page upload already sent its tables
+
+		for (auto &page : pages) //ran out of cache or staging, already loaded so it competes again next frame rather than being read twice
+			vtReady.push_back(std::move(page));
+		for (auto &level : levels)
+			mipReady.push_back(std::move(level));
+
+		VkDeviceSize frameBytes = pageTally.bytes + mipTally.bytes; //what was recorded, not what was picked
+		uploadMetrics.bytes += frameBytes;
+		uploadMetrics.peakFrameBytes = std::max(uploadMetrics.peakFrameBytes, frameBytes);
+		uploadMetrics.copies += pageTally.copies + mipTally.copies;
+		uploadMetrics.queueDepth = vtReady.size() + mipReady.size();
+		uploadMetrics.frames++;
+	}
+
+
+	uint32_t findCacheSlot() { //an empty slot, otherwise the least recently used page not needed this frame
+		uint32_t best = VT_INVALID_KEY;
+
+		for (uint32_t slot = 0; slot < vtSlotKey.size(); slot++) {
+			if (vtSlotKey[slot] == VT_INVALID_KEY)
+				return slot;
+
+			if (vtSlotPinned[slot] || vtSlotLastUsed[slot] == vtFrame)
+				continue;
+
+			if (best == VT_INVALID_KEY || vtSlotLastUsed[slot] < vtSlotLastUsed[best])
+				best = slot;
+		}
+
+		return best;
+	}
+
+	UploadTally uploadVirtualPages(std::vector<LoadedPage> &pages) { //leaves in pages whatever didn't fit, for the caller to keep
+		UploadTally tally;
+		if (pages.empty())
+			return tally;
+
+		VkDeviceSize tableBytes = 0; //every dirty table goes out in this submission, so its staging is held back from the pages
+		for (const auto &vt : virtualTextures)
+			if (vt.indirectionDirty)
+				tableBytes += indirectionTableBytes(vt);
+
+		VkCommandBuffer commandBuffer = beginStreamingCommands();
+
+		recordLayoutTransition(commandBuffer, vtCacheImage, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1);
+
+		size_t consumed = 0;
+		for (; consumed < pages.size(); consumed++) {
+			const LoadedPage &page = pages[consumed];
+			if (page.texels.empty() || vtResident.count(page.key)) //failed read or already resident
+				continue;
+
+			uint32_t slot = findCacheSlot();
+			if (slot == VT_INVALID_KEY)
+				break; //cache is full of pages in use this frame, whatever is left stays ready for next frame
+
+			uint32_t evicted = vtSlotKey[slot] != VT_INVALID_KEY ? pageKeyTexture(vtSlotKey[slot]) : VT_INVALID_KEY;
+			uint32_t owner = pageKeyTexture(page.key);
+
+			VkDeviceSize newTableBytes = 0; //tables this page dirties on top of the ones already held back
+			if (evicted != VT_INVALID_KEY && !virtualTextures[evicted].indirectionDirty)
+				newTableBytes += indirectionTableBytes(virtualTextures[evicted]);
+			if (owner != evicted && !virtualTextures[owner].indirectionDirty)
+				newTableBytes += indirectionTableBytes(virtualTextures[owner]);
+
+			if (!stagingHasRoom(VT_PAGE_BYTES + stagingAlignment + tableBytes + newTableBytes))
+				break; //a slot is only given away once the tables that stop pointing at it are sure to go out with it
+
+			tableBytes += newTableBytes;
+
+			if (evicted != VT_INVALID_KEY) { //evict
+				vtResident.erase(vtSlotKey[slot]);
+				virtualTextures[evicted].indirectionDirty = true;
+			}
+
+			VkDeviceSize offset = acquireStagingRegion(VT_PAGE_BYTES);
+			memcpy(stagingMapped + offset, page.texels.data(), static_cast<size_t>(VT_PAGE_BYTES));
+
+			VkBufferImageCopy region = {};
+			region.bufferOffset = offset;
+			region.bufferRowLength = 0;
+			region.bufferImageHeight = 0;
+			region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+			region.imageSubresource.mipLevel = 0;
+			region.imageSubresource.baseArrayLayer = 0;
+			region.imageSubresource.layerCount = 1;
+			region.imageOffset = { static_cast<int32_t>((slot % VT_CACHE_PAGES) * VT_PAGE_SIZE), static_cast<int32_t>((slot / VT_CACHE_PAGES) * VT_PAGE_SIZE), 0 };
+			region.imageExtent = { VT_PAGE_SIZE, VT_PAGE_SIZE, 1 };
+
+			vkCmdCopyBufferToImage(commandBuffer, stagingSource(), vtCacheImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+
+			vtSlotKey[slot] = page.key;
+			vtSlotLastUsed[slot] = vtFrame;
+			vtResident[page.key] = slot;
+			virtualTextures[owner].indirectionDirty = true;
+
+			tally.bytes += VT_PAGE_BYTES;
+			tally.copies++;
+		}
+
+		pages.erase(pages.begin(), pages.begin() + consumed);
+
+		recordLayoutTransition(commandBuffer, vtCacheImage, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, 1);
+
+		recordIndirectionUpdates(commandBuffer);
+
+		submitUploads(commandBuffer);
+
+		return tally;
+	}
+
+	VkDeviceSize indirectionTableBytes(const VirtualTexture &vt) const { //staging a full rebuild of one texture's table takes, alignment included
+		VkDeviceSize bytes = 0;
+		for (uint32_t mip = 0; mip < vt.mipCount; mip++)
+			bytes += static_cast<VkDeviceSize>(vt.pagesX[mip]) * vt.pagesY[mip] * sizeof(uint32_t) + stagingAlignment;
+
+		return bytes;
+	}
+
+	void flushIndirectionUpdates() { //every frame - a table the staging ring had no room for must not wait on the next page to arrive
+		bool ready = false;
+		for (const auto &vt : virtualTextures)
+			ready = ready || (vt.indirectionDirty && stagingHasRoom(indirectionTableBytes(vt)));
+
+		if (!ready)
+			return;
+
+		VkCommandBuffer commandBuffer = beginStreamingCommands();
+		recordIndirectionUpdates(commandBuffer);
+		submitUploads(commandBuffer);
+	}
+
+	void recordIndirectionUpdates(VkCommandBuffer commandBuffer) {
+		//rebuilt top down so a missing page points at its closest resident ancestor - the shader never has to search
+		uint32_t indirectionLayers = static_cast<uint32_t>(virtualTextures.size());
+		bool transitioned = false;
+
+		for (uint32_t v = 0; v < virtualTextures.size(); v++) {
+			VirtualTexture &vt = virtualTextures[v];
+
+			if (!vt.indirectionDirty)
+				continue;
+
+			if (!stagingHasRoom(indirectionTableBytes(vt)))
+				continue; //stays dirty, flushIndirectionUpdates tries again next frame
+
+			if (!transitioned) {
+				recordLayoutTransition(commandBuffer, vtIndirectionImage, VK_FORMAT_R32_UINT, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, indirectionLayers, vtIndirectionMips);
+				transitioned = true;
+			}
+
+			std::vector<uint32_t> coarser; //entries of the mip above
+
+			for (uint32_t mip = vt.mipCount; mip-- > 0;) {
+				std::vector<uint32_t> entries(static_cast<size_t>(vt.pagesX[mip]) * vt.pagesY[mip]);
+
+				for (uint32_t y = 0; y < vt.pagesY[mip]; y++) {
+					for (uint32_t x = 0; x < vt.pagesX[mip]; x++) {
+						auto slot = vtResident.find(packPageKey(v, mip, x, y));
+
+						if (slot != vtResident.end())
+							entries[y * vt.pagesX[mip] + x] = (slot->second % VT_CACHE_PAGES) | ((slot->second / VT_CACHE_PAGES) << 8) | (mip << 16);
+						else if (!coarser.empty())
+							entries[y * vt.pagesX[mip] + x] = coarser[(y / 2) * vt.pagesX[mip + 1] + x / 2];
+					}
+				}
+
+				VkDeviceSize offset = acquireStagingRegion(entries.size() * sizeof(uint32_t));
+				memcpy(stagingMapped + offset, entries.data(), entries.size() * sizeof(uint32_t));
+
+				VkBufferImageCopy region = {};
+				region.bufferOffset = offset;
+				region.bufferRowLength = 0;
+				region.bufferImageHeight = 0;
+				region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+				region.imageSubresource.mipLevel = mip;
+				region.imageSubresource.baseArrayLayer = v; //one layer per virtual texture
+				region.imageSubresource.layerCount = 1;
+				region.imageOffset = { 0, 0, 0 };
+				region.imageExtent = { vt.pagesX[mip], vt.pagesY[mip], 1 };
+
+				vkCmdCopyBufferToImage(commandBuffer, stagingSource(), vtIndirectionImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+
+				coarser.swap(entries);
+			}
+
+			vt.indirectionDirty = false;
+		}
+
+		if (transitioned)
+			recordLayoutTransition(commandBuffer, vtIndirectionImage, VK_FORMAT_R32_UINT, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, indirectionLayers, vtIndirectionMips);
+	}
+
+	void createFeedbackPass() {
+		//low resolution pass that writes the page key each pixel wants, read back on the host to drive streaming
+		if (virtualTextures.empty())
+			return;
+
+		VkFormat depthFormat = findDepthFormat();
+
+		VkAttachmentDescription keyAttachment = {};
+		keyAttachment.format = VK_FORMAT_R32_UINT;
+		keyAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
+		keyAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+		keyAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+		keyAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+		keyAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+		keyAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+		keyAttachment.finalLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL; //ready for the copy into the slot's readback buffer
+
+		VkAttachmentDescription depthAttachment = {};
+		depthAttachment.format = depthFormat;
+		depthAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
+		depthAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+		depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+		depthAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+		depthAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+		depthAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+		depthAttachment.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+		VkAttachmentReference keyAttachmentRef = {};
+		keyAttachmentRef.attachment = 0;
+		keyAttachmentRef.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+		VkAttachmentReference depthAttachmentRef = {};
+		depthAttachmentRef.attachment = 1;
+		depthAttachmentRef.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+		VkSubpassDescription subpass = {};
+		subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+		subpass.colorAttachmentCount = 1;
+		subpass.pColorAttachments = &keyAttachmentRef;
+		subpass.pDepthStencilAttachment = &depthAttachmentRef;
+
+		std::array<VkSubpassDependency, 2> dependencies = {};
+		dependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL; //last frame's readback copy and depth writes have to finish before we draw over them
+		dependencies[0].dstSubpass = 0;
+		dependencies[0].srcStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+		dependencies[0].srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+		dependencies[0].dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
+		dependencies[0].dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+
+		dependencies[1].srcSubpass = 0; //keys are written before the readback copy
+		dependencies[1].dstSubpass = VK_SUBPASS_EXTERNAL;
+		dependencies[1].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+		dependencies[1].srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+		dependencies[1].dstStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT;
+		dependencies[1].dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+
+		std::array<VkAttachmentDescription, 2> attachments = { keyAttachment, depthAttachment };
+
+		VkRenderPassCreateInfo renderPassInfo = {};
+		renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+		renderPassInfo.attachmentCount = static_cast<uint32_t>(attachments.size());
+		renderPassInfo.pAttachments = attachments.data();
+		renderPassInfo.subpassCount = 1;
+		renderPassInfo.pSubpasses = &subpass;
+		renderPassInfo.dependencyCount = static_cast<uint32_t>(dependencies.size());
+		renderPassInfo.pDependencies = dependencies.data();
+
+		if (vkCreateRenderPass(device, &renderPassInfo, nullptr, &feedbackRenderPass) != VK_SUCCESS)
+			throw std::runtime_error("Failed to create feedback render pass!");
+
+		feedbackVariant = { "shaders/vert.spv", "shaders/feedback.spv", feedbackRenderPass };
+	}
+
+	void createFeedbackTargets() { //everything sized from the swapchain, rebuilt on resize
+		if (virtualTextures.empty())
+			return;
+
+		feedbackExtent.width = std::max(1u, swapChainExtent.width / VT_FEEDBACK_DIVISOR);
+		feedbackExtent.height = std::max(1u, swapChainExtent.height / VT_FEEDBACK_DIVISOR);
+
+		VkFormat depthFormat = findDepthFormat();
+
+		createImage(feedbackExtent.width, feedbackExtent.height, VK_FORMAT_R32_UINT, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, feedbackImage, feedbackImageMem);
+		createImage(feedbackExtent.width, feedbackExtent.height, depthFormat, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
+			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, feedbackDepthImage, feedbackDepthImageMem);
+
+		VkImageSubresourceRange subresourceRange = {};
+		subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		subresourceRange.baseMipLevel = 0;
+		subresourceRange.levelCount = 1;
+		subresourceRange.baseArrayLayer = 0;
+		subresourceRange.layerCount = 1;
+
+		ovgfCreateImageView(feedbackImage, VK_IMAGE_VIEW_TYPE_2D, VK_FORMAT_R32_UINT, { VK_COMPONENT_SWIZZLE_IDENTITY }, subresourceRange, &feedbackImgView);
+
+		subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+		ovgfCreateImageView(feedbackDepthImage, VK_IMAGE_VIEW_TYPE_2D, depthFormat, { VK_COMPONENT_SWIZZLE_IDENTITY }, subresourceRange, &feedbackDepthImgView);
+
+		std::array<VkImageView, 2> fbAttachments = { feedbackImgView, feedbackDepthImgView };
+
+		VkFramebufferCreateInfo framebufferInfo = {};
+		framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+		framebufferInfo.renderPass = feedbackRenderPass;
+		framebufferInfo.attachmentCount = static_cast<uint32_t>(fbAttachments.size());
+		framebufferInfo.pAttachments = fbAttachments.data();
+		framebufferInfo.width = feedbackExtent.width;
+		framebufferInfo.height = feedbackExtent.height;
+		framebufferInfo.layers = 1;
+
+		if (vkCreateFramebuffer(device, &framebufferInfo, nullptr, &feedbackFramebuffer) != VK_SUCCESS)
+			throw std::runtime_error("Failed to create feedback framebuffer.");
+
+		VkDeviceSize readbackSize = static_cast<VkDeviceSize>(feedbackExtent.width) * feedbackExtent.height * sizeof(uint32_t);
+		for (auto &readback : feedbackReadbacks) { //frames in flight each copy into their own, the host never reads one a copy may still be writing
+			createBuffer(readbackSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, readback.buffer, readback.memory);
+
+			readback.mapped = static_cast<uint32_t *>(readback.memory.mapped); //stays mapped, read when its slot comes round again
+			readback.written = false; //nothing requested until the slot's first pass runs
+		}
+	}
+
+	void recordFeedbackPass(VkCommandBuffer commandBuffer, uint32_t uniformOffset, VkPipeline feedbackPipeline) {
+		VkRenderPassBeginInfo renderPassInfo = {};
+		renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+		renderPassInfo.renderPass = feedbackRenderPass;
+		renderPassInfo.framebuffer = feedbackFramebuffer;
+		renderPassInfo.renderArea.extent = feedbackExtent;
+		renderPassInfo.renderArea.offset = { 0, 0 };
+
+		std::array<VkClearValue, 2> clearValues = {};
+		clearValues[0].color.uint32[0] = VT_INVALID_KEY; //pixels nothing covers ask for nothing
+		clearValues[1].depthStencil = { 1.0f, 0 };
+
+		renderPassInfo.clearValueCount = static_cast<uint32_t>(clearValues.size());
+		renderPassInfo.pClearValues = clearValues.data();
+
+		vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+
+		vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, feedbackPipeline);
+		setViewport(commandBuffer, feedbackExtent);
+
+		VkBuffer vertexBuffers[] = { vertexBuffer };
+		VkDeviceSize offsets[] = { 0 };
+		vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
+
+		vkCmdBindIndexBuffer(commandBuffer, indexBuffer, 0, VK_INDEX_TYPE_UINT32);
+
+		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &desSet, 1, &uniformOffset);
+
+		recordDraws(commandBuffer, 0, drawList.size()); //same transforms as the scene, or the feedback would ask for the wrong pages
+
+		vkCmdEndRenderPass(commandBuffer);
+
+		VkBufferImageCopy region = {};
+		region.bufferOffset = 0;
+		region.bufferRowLength = 0;
+		region.bufferImageHeight = 0;
+		region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		region.imageSubresource.mipLevel = 0;
+		region.imageSubresource.baseArrayLayer = 0;
+		region.imageSubresource.layerCount = 1;
+		region.imageOffset = { 0, 0, 0 };
+		region.imageExtent = { feedbackExtent.width, feedbackExtent.height, 1 };
+
+		FeedbackReadback &slotReadback = feedbackReadbacks[currentFrame];
+		vkCmdCopyImageToBuffer(commandBuffer, feedbackImage, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, slotReadback.buffer, 1, &region);
+		slotReadback.written = true;
+
+		VkBufferMemoryBarrier readback = {}; //make the keys visible to updateVirtualTextures once the slot's fence is waited on
+		readback.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+		readback.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		readback.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+		readback.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		readback.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		readback.buffer = slotReadback.buffer;
+		readback.offset = 0;
+		readback.size = VK_WHOLE_SIZE;
+
+		vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 0, nullptr, 1, &readback, 0, nullptr);
+	}
+
+	void retireFeedbackTargets() {
+		if (virtualTextures.empty())
+			return;
+
+		GpuTimepoint inUse = gpuNow();
+		deferDestroyFramebuffer(feedbackFramebuffer, inUse);
+		deferDestroyImageView(feedbackDepthImgView, inUse);
+		deferDestroyImageView(feedbackImgView, inUse);
+		deferDestroyImage(feedbackDepthImage, feedbackDepthImageMem, inUse);
+		deferDestroyImage(feedbackImage, feedbackImageMem, inUse);
+		for (auto &readback : feedbackReadbacks) { //may still be written by frames in flight, nobody reads them from here on
+			deferDestroyBuffer(readback.buffer, readback.memory, inUse);
+			readback.mapped = nullptr;
+			readback.written = false;
+		}
+	}
+
+	void cleanupFeedbackPass() {
+		if (virtualTextures.empty())
+			return;
+
+		vkDestroyRenderPass(device, feedbackRenderPass, nullptr); //the pipeline belongs to pipelineVariants
+	}
+
+	void createImage(uint32_t width, uint32_t height, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage& image, MemoryAllocation& imageMemory, uint32_t arrayLayers = 1, uint32_t mipLevels = 1) {
+		VkImageCreateInfo imageInfo = {};
+		imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+		imageInfo.imageType = VK_IMAGE_TYPE_2D; //texel coordinate system
+		imageInfo.extent.width = width; //width of the image
+		imageInfo.extent.height = height; //height of the image
+		imageInfo.extent.depth = 1; //no depth on a 2d image but still has one "row"
+		imageInfo.mipLevels = mipLevels; //one unless the caller streams or indexes mips
+		imageInfo.arrayLayers = arrayLayers; //one layer unless we're packing a texture array
+		imageInfo.tiling = tiling; //using a staging buffer so we don't need texel access
+		imageInfo.format = format; //texel format
+		imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED; //we don't need to preserve any initial texel data
+		imageInfo.usage = usage; //the image is going to recieve data from our staging buffer and we need access to the image from the shader
+		imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE; //the graphics queue implicitly supports memory transfers so only one queue will use this image
+		imageInfo.samples = VK_SAMPLE_COUNT_1_BIT; //No multisampling
+		imageInfo.flags = 0; //No flags for now - optional
+
+		if (vkCreateImage(device, &imageInfo, nullptr, &image) != VK_SUCCESS) //crash if we don't create an image
+			throw std::runtime_error("Failed to create image");
+
+		VkMemoryRequirements memReqs;
+		vkGetImageMemoryRequirements(device, image, &memReqs); //query our texture image for its memory requirements
+
+		bool renderTarget = (usage & (VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT)) != 0; //recreated with the swapchain, keep them out of the shared blocks
+		imageMemory = memoryAllocator.allocate(memReqs, findMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT), tiling == VK_IMAGE_TILING_LINEAR, renderTarget); //find memory with the properties we need, ensure it's device local
+
+		vkBindImageMemory(device, image, imageMemory.memory, imageMemory.offset); //bind our image to its range of the allocation
+	}
+
+
+	void loadModel(const std::string fileName) {
+		tinyobj::attrib_t attrib;
+		std::vector<tinyobj::shape_t> shapes;
+		std::vector<tinyobj::material_t> materials;
+		std::string err;
+
+		if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &err, (MODEL_PATH_ROOT + fileName).c_str())) //super slow. TODO: Write threaded file loader for large models
+			throw std::runtime_error(err);
+
+		textureFiles = { DEFAULT_TEXTURE };
+		std::vector<uint32_t> materialMap(materials.size(), 0); //obj material id -> index into our material table, 0 is the default texture
+
+		for (size_t m = 0; m < materials.size(); m++) {
+			const std::string &texName = materials[m].diffuse_texname;
+
+			if (texName.empty() || !std::ifstream(TEXTURE_PATH_ROOT + texName).good()) //keep the default for textures we don't ship
+				continue;
+
+			auto found = std::find(textureFiles.begin(), textureFiles.end(), texName);
+			if (found == textureFiles.end()) {
+				if (textureFiles.size() == MAX_MATERIALS)
+					continue;
+				found = textureFiles.insert(textureFiles.end(), texName);
+			}
+
+			materialMap[m] = static_cast<uint32_t>(found - textureFiles.begin());
+		}
+
+		materialBounds.assign(textureFiles.size(), MaterialBounds());
+
+		std::unordered_map<Vertex, uint32_t> uniqueVerticies = {};
+		int i = 0;
+
+		drawList.clear();
+
+		for (const auto &shape : shapes) {
+			uint32_t firstIndex = static_cast<uint32_t>(vIndices.size());
+			Vertex vertex[3] = {}; //stupid redefine
+			size_t face = 0; //material ids are stored per face
+			for (const auto &index : shape.mesh.indices) {
+
+				vertex[i].pos = {
 					attrib.vertices[3 * index.vertex_index + 0],
 					attrib.vertices[3 * index.vertex_index + 1],
 					attrib.vertices[3 * index.vertex_index + 2]
@@ -1230,6 +4167,9 @@ private:
 
 				vertex[i].color = { 1.0f, 1.0f, 1.0f };
 
+				int materialId = face < shape.mesh.material_ids.size() ? shape.mesh.material_ids[face] : -1;
+				vertex[i].material = materialId >= 0 ? materialMap[materialId] : 0;
+
 				if (uniqueVerticies.count(vertex[i]) == 0) {
 					uniqueVerticies[vertex[i]] = static_cast<uint32_t>(vertices.size());
 					vertices.push_back(vertex[i]);
@@ -1246,6 +4186,16 @@ private:
 					glm::vec3 v2 = vertex[2].pos - vertex[0].pos;
 					glm::vec3 normal = glm::cross(v1, v2);
 
+					MaterialBounds &bounds = materialBounds[vertex[0].material]; //texel density and extent for mip streaming
+					for (const auto &corner : vertex) {
+						bounds.min = glm::min(bounds.min, corner.pos);
+						bounds.max = glm::max(bounds.max, corner.pos);
+					}
+					glm::vec2 t1 = vertex[1].tex - vertex[0].tex;
+					glm::vec2 t2 = vertex[2].tex - vertex[0].tex;
+					bounds.worldArea += 0.5 * glm::length(normal);
+					bounds.uvArea += 0.5 * std::abs(t1.x * t2.y - t1.y * t2.x);
+
 #ifndef NDEBUG
 #ifdef DVERBOSE
 					std::cout << "vertex 0 " << vertex[0].pos.x << "x " << vertex[0].pos.y << "y " << vertex[0].pos.z << "z " << std::endl;
@@ -1257,83 +4207,478 @@ private:
 #endif
 #endif
 
-					//naive approach while debugging
-					vertices.at(uniqueVerticies[vertex[0]]).normal += 1000.0f * normal;
-					vertices.at(uniqueVerticies[vertex[1]]).normal += normal * 1000.0f;
-					vertices.at(uniqueVerticies[vertex[2]]).normal += normal * 1000.0f;
-					//normals seem abysmally small, scaling to test
+					//naive approach while debugging
+					vertices.at(uniqueVerticies[vertex[0]]).normal += 1000.0f * normal;
+					vertices.at(uniqueVerticies[vertex[1]]).normal += normal * 1000.0f;
+					vertices.at(uniqueVerticies[vertex[2]]).normal += normal * 1000.0f;
+					//normals seem abysmally small, scaling to test
+
+					i = 0;
+					face++;
+				}	
+			}
+
+			//faces grouped by material, a draw each - the fragment shader picks the detail image by material, which has to be the same across a draw
+			std::vector<std::array<uint32_t, 3>> faces;
+			for (size_t f = firstIndex; f + 2 < vIndices.size(); f += 3)
+				faces.push_back({ { vIndices[f], vIndices[f + 1], vIndices[f + 2] } });
+
+			std::stable_sort(faces.begin(), faces.end(), [this](const std::array<uint32_t, 3> &a, const std::array<uint32_t, 3> &b) {
+				return vertices[a[0]].material < vertices[b[0]].material;
+			});
+
+			for (size_t f = 0; f < faces.size(); f++)
+				std::copy(faces[f].begin(), faces[f].end(), vIndices.begin() + firstIndex + 3 * f);
+
+			for (size_t f = 0; f < faces.size();) {
+				size_t end = f;
+				while (end < faces.size() && vertices[faces[end][0]].material == vertices[faces[f][0]].material)
+					end++;
+
+				drawList.push_back({ firstIndex + static_cast<uint32_t>(3 * f), static_cast<uint32_t>(3 * (end - f)), glm::mat4(1.0f) });
+				f = end;
+			}
+		}
+
+#ifndef DVERBOSE
+		std::cout << "Finished loading model." << std::endl;
+#ifdef DPAUSE
+		std::cin; //debug pause
+#endif
+#endif
+		
+		for (auto &vertex : vertices) {
+			glm::normalize(vertex.normal);
+
+#ifdef DVERBOSE
+			std::cout << vertex.normal.x << "x " << vertex.normal.y << "y " << vertex.normal.z << "z " << std::endl;
+#endif
+		}
+
+#ifdef DPAUSE
+		std::cin; //pause and ponder the broken state of the normal vectors and my life
+#endif
+
+	}
+
+
+	void createVertexBuffer() {
+		VkDeviceSize bufferSize = sizeof(vertices[0]) * vertices.size();
+
+		createStagedBuffer(bufferSize, vertices.data(), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, 0, vertexBuffer, vertexBufferMemory);
+	}
+
+	void createIndexBuffer() {
+		VkDeviceSize bufferSize = sizeof(vIndices[0]) * vIndices.size();
+
+		createStagedBuffer(bufferSize, vIndices.data(), VK_BUFFER_USAGE_INDEX_BUFFER_BIT, 0, indexBuffer, indexBufferMemory);
+
+	}
+
+	UploadToken createStagedBuffer(VkDeviceSize bufferSize, const void *data, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer &buffer, MemoryAllocation &bufferMemory) {
+		if (unifiedMemory) { //write straight into the final buffer - host writes before a submit are visible to it, so there's nothing to wait for
+			createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | usage, UNIFIED_MEMORY_FLAGS | properties, buffer, bufferMemory);
+			memcpy(bufferMemory.mapped, data, static_cast<size_t>(bufferSize));
+			return completedUpload;
+		}
+
+		createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | properties, buffer, bufferMemory);
+
+		if (bufferSize <= STAGING_BUFFER_SIZE / 2 && !stagingHasRoom(bufferSize)) //the batch holds the rest of the ring
+			flushUploadBatch();
+
+		recordBufferUpload(batchCommands(), data, bufferSize, buffer);
+
+		return uploadSerial + 1; //the batch's token - draws are submitted after it on the same queue and the upload barrier orders them after the copy
+	}
+
+	void recordBufferUpload(VkCommandBuffer commandBuffer, const void *data, VkDeviceSize size, VkBuffer dstBuffer, VkDeviceSize dstOffset = 0) {
+		VkBuffer srcBuffer = stagingSource();
+		VkDeviceSize srcOffset = 0;
+
+		if (size <= STAGING_BUFFER_SIZE / 2) {
+			srcOffset = acquireStagingRegion(size);
+			memcpy(stagingMapped + srcOffset, data, static_cast<size_t>(size)); //straight from the caller's memory into the ring
+		} else { //too big to share the ring
+			MemoryAllocation tempBuffMem;
+			stageInTempBuffer(data, size, srcBuffer, tempBuffMem);
+			releaseAfterUpload(srcBuffer, tempBuffMem);
+		}
+
+		VkBufferCopy copyRegion = {};
+		copyRegion.srcOffset = srcOffset;
+		copyRegion.dstOffset = dstOffset;
+		copyRegion.size = size;
+		vkCmdCopyBuffer(commandBuffer, srcBuffer, dstBuffer, 1, &copyRegion);
+
+		VkBufferMemoryBarrier barrier = {}; //whatever reads the buffer next waits on the copy
+		barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+		barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		barrier.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT | VK_ACCESS_UNIFORM_READ_BIT;
+		barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.buffer = dstBuffer;
+		barrier.offset = dstOffset;
+		barrier.size = size;
+
+		vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 1, &barrier, 0, nullptr);
+	}
+
+	void detectUnifiedMemory() {
+		//true when the biggest device local heap can also be written by the host, as on integrated GPUs and lavapipe/SwiftShader
+		VkPhysicalDeviceMemoryProperties memProp;
+		vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memProp);
+
+		VkDeviceSize largestLocalHeap = 0;
+		for (uint32_t i = 0; i < memProp.memoryHeapCount; i++)
+			if (memProp.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT)
+				largestLocalHeap = std::max(largestLocalHeap, memProp.memoryHeaps[i].size);
+
+		for (uint32_t i = 0; i < memProp.memoryTypeCount; i++) //a discrete card's small host visible window into vram doesn't count
+			if ((memProp.memoryTypes[i].propertyFlags & UNIFIED_MEMORY_FLAGS) == UNIFIED_MEMORY_FLAGS && memProp.memoryHeaps[memProp.memoryTypes[i].heapIndex].size == largestLocalHeap)
+				unifiedMemory = true;
+
+#ifndef NDEBUG
+		if (unifiedMemory)
+			std::cout << "Unified memory: buffers are written in place, textures copy from device local staging." << std::endl;
+#endif
+	}
+
+	void createStagingBuffer() {
+		VkMemoryPropertyFlags stagingFlags = unifiedMemory ? UNIFIED_MEMORY_FLAGS : VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT; //texture copies then never leave device memory
+		std::vector<uint32_t> stagingFamilies = { static_cast<uint32_t>(indicies.graphicsFamily) }; //load batches read the ring on the graphics queue, streaming on the transfer queue
+		if (transferQueue != VK_NULL_HANDLE)
+			stagingFamilies.push_back(static_cast<uint32_t>(indicies.transferFamily));
+		createBuffer(STAGING_BUFFER_SIZE, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, stagingFlags, stagingBuffer, stagingBufferMemory, stagingFamilies);
+
+		stagingMapped = static_cast<unsigned char *>(stagingBufferMemory.mapped); //mapped by the allocator, stays mapped until cleanup
+
+		if (transferQueue != VK_NULL_HANDLE && !unifiedMemory) //nothing to move across a bus
+			createBuffer(STAGING_BUFFER_SIZE, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, landingBuffer, landingBufferMemory);
+
+		VkPhysicalDeviceProperties props;
+		vkGetPhysicalDeviceProperties(physicalDevice, &props);
+		stagingAlignment = std::max<VkDeviceSize>(stagingAlignment, props.limits.optimalBufferCopyOffsetAlignment); //texel copies need at least 4, 16 keeps every format happy
+	}
+
+	bool stagingFits(VkDeviceSize size, VkDeviceSize &offset, VkDeviceSize &consumed) const {
+		VkDeviceSize position = stagingHead % STAGING_BUFFER_SIZE;
+		offset = (position + stagingAlignment - 1) / stagingAlignment * stagingAlignment; //round up to the copy alignment
+
+		if (offset + size > STAGING_BUFFER_SIZE) //doesn't fit before the end, skip the rest and wrap around
+			offset = 0;
+
+		consumed = (offset < position ? STAGING_BUFFER_SIZE - position : offset - position) + size;
+		return stagingHead - stagingTail + consumed <= STAGING_BUFFER_SIZE;
+	}
+
+	bool stagingHasRoom(VkDeviceSize size) { //never blocks - false means submit what's recorded or try again next frame
+		retireUploads();
+
+		VkDeviceSize offset, consumed;
+		return stagingFits(size, offset, consumed);
+	}
+
+	VkDeviceSize acquireStagingRegion(VkDeviceSize size) {
+		VkDeviceSize offset, consumed;
+
+		while (!stagingFits(size, offset, consumed))
+			if (!waitOldestUpload()) //the rest of the ring is held by commands that haven't been submitted yet
+				throw std::runtime_error("Staging buffer exhausted.");
+
+		stagingHead += consumed;
+		return offset;
+	}
+
+	void releaseAfterUpload(VkBuffer buffer, MemoryAllocation &memory) { //destroyed once the next submitted upload has finished
+		pendingTempBuffers.push_back({ buffer, memory });
+	}
+
+	VkCommandBuffer batchCommands() { //the open load phase batch, started on first use
+		if (uploadBatch == VK_NULL_HANDLE)
+			uploadBatch = beginSingleTimeCommands();
+
+		return uploadBatch;
+	}
+
+	UploadToken flushUploadBatch() { //returns the batch's token, or the last one if nothing was recorded
+		if (uploadBatch == VK_NULL_HANDLE)
+			return uploadSerial;
+
+		VkCommandBuffer batch = uploadBatch;
+		uploadBatch = VK_NULL_HANDLE;
+		return submitUploads(batch);
+	}
+
+	VkCommandBuffer beginStreamingCommands() { //runtime uploads - moved over the transfer queue when the device has one
+		flushUploadBatch(); //the batch's staging bytes have to come before ours in the ring
+		streamingRecording = landingBuffer != VK_NULL_HANDLE;
+		return beginSingleTimeCommands();
+	}
+
+	VkBuffer stagingSource() const { //what copies being recorded read from - the landing buffer mirrors the ring offset for offset
+		return streamingRecording ? landingBuffer : stagingBuffer;
+	}
+
+	UploadToken submitUploads(VkCommandBuffer commandBuffer) {
+		if (uploadBatch != VK_NULL_HANDLE && commandBuffer != uploadBatch) //keep submission order the same as recording order
+			flushUploadBatch();
+
+		vkEndCommandBuffer(commandBuffer);
+
+		StagingSubmission submission;
+		submission.commandBuffer = commandBuffer;
+		submission.ringEnd = stagingHead;
+		submission.token = ++uploadSerial;
+
+		for (auto &temp : pendingTempBuffers) //oversized uploads that bypassed the ring go once this submission has
+			deferDestroyBuffer(temp.first, temp.second, { 0, submission.token });
+		pendingTempBuffers.clear();
+
+		if (streamingRecording) {
+			streamingRecording = false;
+			submitTransfer(submission);
+		}
+
+		stagingSubmitted = stagingHead;
+		uploadsPending.push_back(std::move(submission));
+		promoteUploads(false);
+
+		return uploadSerial;
+	}
+
+	void submitTransfer(StagingSubmission &submission) {
+		//moves the ring bytes written since the last submit into device local memory on the transfer queue, the graphics side copies out of that instead
+		std::vector<VkBufferCopy> ranges;
+		VkDeviceSize start = stagingSubmitted % STAGING_BUFFER_SIZE, size = stagingHead - stagingSubmitted;
+
+		if (start + size > STAGING_BUFFER_SIZE) { //wrapped around
+			ranges.push_back({ start, start, STAGING_BUFFER_SIZE - start });
+			size -= STAGING_BUFFER_SIZE - start;
+			start = 0;
+		}
+		if (size > 0)
+			ranges.push_back({ start, start, size });
+
+		std::vector<VkBufferMemoryBarrier> ownership(ranges.size()); //same ranges released by transfer and acquired by graphics
+		for (size_t i = 0; i < ranges.size(); i++) {
+			ownership[i].sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+			ownership[i].srcQueueFamilyIndex = indicies.transferFamily;
+			ownership[i].dstQueueFamilyIndex = indicies.graphicsFamily;
+			ownership[i].buffer = landingBuffer;
+			ownership[i].offset = ranges[i].dstOffset;
+			ownership[i].size = ranges[i].size;
+		}
+
+		submission.transferCommands = beginCommands(transferCommandPool);
+		if (!ranges.empty())
+			vkCmdCopyBuffer(submission.transferCommands, stagingBuffer, landingBuffer, static_cast<uint32_t>(ranges.size()), ranges.data());
+		for (auto &barrier : ownership) { //release
+			barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+			barrier.dstAccessMask = 0;
+		}
+		if (!ownership.empty())
+			vkCmdPipelineBarrier(submission.transferCommands, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, static_cast<uint32_t>(ownership.size()), ownership.data(), 0, nullptr);
+		vkEndCommandBuffer(submission.transferCommands);
+
+		submission.acquireCommands = beginCommands(commandPool);
+		for (auto &barrier : ownership) { //acquire
+			barrier.srcAccessMask = 0;
+			barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+		}
+		if (!ownership.empty())
+			vkCmdPipelineBarrier(submission.acquireCommands, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, static_cast<uint32_t>(ownership.size()), ownership.data(), 0, nullptr);
+		vkEndCommandBuffer(submission.acquireCommands);
+
+		submission.transferFence = takeUploadFence();
+
+		if (freeUploadSemaphores.empty()) {
+			VkSemaphoreCreateInfo semaphoreInfo = {};
+			semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+
+			if (vkCreateSemaphore(device, &semaphoreInfo, nullptr, &submission.transferDone) != VK_SUCCESS)
+				throw std::runtime_error("Failed to create transfer semaphore.");
+		} else {
+			submission.transferDone = freeUploadSemaphores.back();
+			freeUploadSemaphores.pop_back();
+		}
+
+		VkSubmitInfo submitInfo = {};
+		submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+		submitInfo.commandBufferCount = 1;
+		submitInfo.pCommandBuffers = &submission.transferCommands;
+		submitInfo.signalSemaphoreCount = 1;
+		submitInfo.pSignalSemaphores = &submission.transferDone;
+
+		if (vkQueueSubmit(transferQueue, 1, &submitInfo, submission.transferFence) != VK_SUCCESS)
+			throw std::runtime_error("Failed to submit transfer command buffer.");
+	}
+
+	bool promoteOldestUpload(bool wait) {
+		//graphics work of an upload goes on the queue once its transfer has landed, so frames keep rendering while the copy is in flight
+		StagingSubmission &oldest = uploadsPending.front();
+
+		if (oldest.transferFence != VK_NULL_HANDLE) {
+			if (wait)
+				vkWaitForFences(device, 1, &oldest.transferFence, VK_TRUE, std::numeric_limits<uint64_t>::max());
+			else if (vkGetFenceStatus(device, oldest.transferFence) != VK_SUCCESS)
+				return false;
+		}
+
+		oldest.fence = takeUploadFence();
+
+		VkCommandBuffer commandBuffers[] = { oldest.acquireCommands, oldest.commandBuffer };
+		VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+		bool transferred = oldest.transferDone != VK_NULL_HANDLE;
+
+		VkSubmitInfo submitInfo = {};
+		submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+		submitInfo.waitSemaphoreCount = transferred ? 1 : 0; //already signalled, only there for the memory dependency
+		submitInfo.pWaitSemaphores = &oldest.transferDone;
+		submitInfo.pWaitDstStageMask = &waitStage;
+		submitInfo.commandBufferCount = transferred ? 2 : 1;
+		submitInfo.pCommandBuffers = transferred ? commandBuffers : &oldest.commandBuffer;
+
+		if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, oldest.fence) != VK_SUCCESS)
+			throw std::runtime_error("Failed to submit upload command buffer.");
+
+		uploadsInFlight.push_back(std::move(oldest));
+		uploadsPending.pop_front();
+		return true;
+	}
+
+	void promoteUploads(bool wait) {
+		while (!uploadsPending.empty() && promoteOldestUpload(wait));
+	}
+
+	bool waitOldestUpload() { //blocks on whichever upload is oldest, false when there's nothing to wait for
+		if (uploadsInFlight.empty() && !uploadsPending.empty())
+			promoteOldestUpload(true);
+
+		if (uploadsInFlight.empty())
+			return false;
 
-					i = 0;
-				}	
-			}
-		}
+		retireOldestUpload(true);
+		return true;
+	}
 
-#ifndef DVERBOSE
-		std::cout << "Finished loading model." << std::endl;
-#ifdef DPAUSE
-		std::cin; //debug pause
-#endif
-#endif
-		
-		for (auto &vertex : vertices) {
-			glm::normalize(vertex.normal);
+	VkFence takeUploadFence() {
+		VkFence fence;
 
-#ifdef DVERBOSE
-			std::cout << vertex.normal.x << "x " << vertex.normal.y << "y " << vertex.normal.z << "z " << std::endl;
-#endif
+		if (freeUploadFences.empty()) {
+			VkFenceCreateInfo fenceInfo = {};
+			fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+
+			if (vkCreateFence(device, &fenceInfo, nullptr, &fence) != VK_SUCCESS)
+				throw std::runtime_error("Failed to create upload fence.");
+		} else {
+			fence = freeUploadFences.back();
+			freeUploadFences.pop_back();
 		}
 
-#ifdef DPAUSE
-		std::cin; //pause and ponder the broken state of the normal vectors and my life
-#endif
+		return fence;
+	}
 
+	void recycleUploadFence(VkFence fence) {
+		vkResetFences(device, 1, &fence);
+		freeUploadFences.push_back(fence);
 	}
 
+	bool retireOldestUpload(bool wait) {
+		StagingSubmission &oldest = uploadsInFlight.front();
 
-	void createVertexBuffer() {
-		VkDeviceSize bufferSize = sizeof(vertices[0]) * vertices.size();
+		if (wait)
+			vkWaitForFences(device, 1, &oldest.fence, VK_TRUE, std::numeric_limits<uint64_t>::max());
+		else if (vkGetFenceStatus(device, oldest.fence) != VK_SUCCESS)
+			return false;
 
-		createStagedBuffer(bufferSize, vertices, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, 0, vertexBuffer, vertexBufferMemory);
-	}
+		recycleUploadFence(oldest.fence);
+		vkFreeCommandBuffers(device, commandPool, 1, &oldest.commandBuffer);
 
-	void createIndexBuffer() {
-		VkDeviceSize bufferSize = sizeof(vIndices[0]) * vIndices.size();
+		if (oldest.transferFence != VK_NULL_HANDLE) {
+			recycleUploadFence(oldest.transferFence);
+			freeUploadSemaphores.push_back(oldest.transferDone); //the graphics wait unsignalled it
+			vkFreeCommandBuffers(device, transferCommandPool, 1, &oldest.transferCommands);
+			vkFreeCommandBuffers(device, commandPool, 1, &oldest.acquireCommands);
+		}
 
-		createStagedBuffer(bufferSize, vIndices, VK_BUFFER_USAGE_INDEX_BUFFER_BIT, 0, indexBuffer, indexBufferMemory);
+		stagingTail = oldest.ringEnd; //landing bytes are free too, the graphics copies out of them are done
+		completedUpload = oldest.token;
+		uploadsInFlight.pop_front();
 
+		collectDeletions(); //the load phase has no frames, uploads are what move it along
+		return true;
 	}
 
-	template<typename T, typename A>
-	void createStagedBuffer(VkDeviceSize bufferSize, std::vector<T, A> in, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer &buffer, VkDeviceMemory &bufferMemory) {
+	void retireUploads() { //hands back everything the GPU has finished with and queues landed transfers, never blocks
+		promoteUploads(false);
+		while (!uploadsInFlight.empty() && retireOldestUpload(false));
+	}
 
-		VkBuffer stagingBuffer;
-		VkDeviceMemory stagingBufferMemory;
-		createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
+	void waitForUpload(UploadToken token) { //only for the host - the GPU side is ordered by submission order and barriers
+		if (token > uploadSerial) //still recording in the batch
+			flushUploadBatch();
 
-		void *data;
-		vkMapMemory(device, stagingBufferMemory, 0, bufferSize, 0, &data);
-		memcpy(data, in.data(), (size_t)bufferSize);
-		vkUnmapMemory(device, stagingBufferMemory);
+		while (completedUpload < token && waitOldestUpload());
+	}
 
-		createBuffer(bufferSize, VK_IMAGE_USAGE_TRANSFER_DST_BIT | usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, buffer, bufferMemory);
+	void finishUploads() { //before anything an upload touches goes away
+		waitForUpload(flushUploadBatch());
 
-		copyBuffer(stagingBuffer, buffer, bufferSize);
+		for (auto fence : freeUploadFences)
+			vkDestroyFence(device, fence, nullptr);
+		freeUploadFences.clear();
 
-		vkDestroyBuffer(device, stagingBuffer, nullptr);
-		vkFreeMemory(device, stagingBufferMemory, nullptr);
+		for (auto semaphore : freeUploadSemaphores)
+			vkDestroySemaphore(device, semaphore, nullptr);
+		freeUploadSemaphores.clear();
+	}
+
+	void createMaterialBuffer() {
+		VkDeviceSize bufferSize = sizeof(Material) * MAX_MATERIALS;
+
+		createStagedBuffer(bufferSize, materials.data(), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, 0, materialBuffer, materialBufferMemory);
 	}
 
 	void createUniformBuffer() {
-		VkDeviceSize bufferSize = sizeof(UniformBufferObject);
-		createBuffer(bufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, uniformBuffer, uniformBufferMemory);
+		//the frame using an image only ever reads that image's slot, so the host can write the next frame's while earlier ones are still in flight
+		VkPhysicalDeviceProperties props;
+		vkGetPhysicalDeviceProperties(physicalDevice, &props);
+
+		VkDeviceSize alignment = std::max<VkDeviceSize>(props.limits.minUniformBufferOffsetAlignment, 1);
+		uniformStride = (sizeof(UniformBufferObject) + alignment - 1) / alignment * alignment;
+		uniformSlots = static_cast<uint32_t>(swapChainImages.size());
+
+		createBuffer(uniformStride * uniformSlots, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, uniformBuffer, uniformBufferMemory);
+	}
+
+	void growUniformBuffer() { //a recreated swapchain can come back with more images than there are slots
+		if (swapChainImages.size() <= uniformSlots)
+			return;
+
+		VkDescriptorSet fresh; //frames in flight keep the old buffer through the old set, both go once they finish
+		if (!allocateDescriptorSet(fresh))
+			throw std::runtime_error("Failed to allocate descriptor set for the grown uniform buffer");
+
+		deferDestroyBuffer(uniformBuffer, uniformBufferMemory, gpuNow());
+		createUniformBuffer();
+
+		swapDescriptorSet(fresh);
 	}
 
-	void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer &buffer, VkDeviceMemory &bufferMemory) {
+	void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer &buffer, MemoryAllocation &bufferMemory, const std::vector<uint32_t> &queueFamilies = std::vector<uint32_t>()) { //queueFamilies - families that use it without ownership transfers
 		VkBufferCreateInfo bufferInfo = {};
 		bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
 		bufferInfo.size = size;
 		bufferInfo.usage = usage;
-		bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+		if (queueFamilies.size() > 1) {
+			bufferInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+			bufferInfo.queueFamilyIndexCount = static_cast<uint32_t>(queueFamilies.size());
+			bufferInfo.pQueueFamilyIndices = queueFamilies.data();
+		} else {
+			bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+		}
 
 		if (vkCreateBuffer(device, &bufferInfo, nullptr, &buffer) != VK_SUCCESS)
 			throw std::runtime_error("Failed to create vertex buffer.");
@@ -1341,15 +4686,9 @@ private:
 		VkMemoryRequirements memReq;
 		vkGetBufferMemoryRequirements(device, buffer, &memReq);
 
-		VkMemoryAllocateInfo allocInfo = {};
-		allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-		allocInfo.allocationSize = memReq.size;
-		allocInfo.memoryTypeIndex = findMemoryType(memReq.memoryTypeBits, properties);
-
-		if (vkAllocateMemory(device, &allocInfo, nullptr, &bufferMemory) != VK_SUCCESS)
-			throw std::runtime_error("Failed to allocate vertex buffer memory.");
+		bufferMemory = memoryAllocator.allocate(memReq, findMemoryType(memReq.memoryTypeBits, properties), true); //buffers are always linear
 
-		vkBindBufferMemory(device, buffer, bufferMemory, 0);
+		vkBindBufferMemory(device, buffer, bufferMemory.memory, bufferMemory.offset);
 	}
 
 	uint32_t findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties) {
@@ -1363,44 +4702,16 @@ private:
 		throw std::runtime_error("Failed to find suitable memory type.");
 	}
 
-	void copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size) {
-		VkCommandBuffer commandBuffer = beginSingleTimeCommands();
-
-		VkBufferCopy copyRegion = {};
-		copyRegion.srcOffset = 0; //Offset if data interlaced
-		copyRegion.dstOffset = 0; //Offset of destinaion if interlaced
-		copyRegion.size = size; //size of the memory region to copy
-		vkCmdCopyBuffer(commandBuffer, srcBuffer, dstBuffer, 1, &copyRegion); //record the copy command
-
-		endSingleTimeCommands(commandBuffer);
-	}
-
-	void copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width, uint32_t height) {
-		VkCommandBuffer commandBuffer = beginSingleTimeCommands();
-
-		VkBufferImageCopy region = {};
-		region.bufferOffset = 0; //start at the beggining of the buffer
-		region.bufferRowLength = 0; //no row padding - tightly packed
-		region.bufferImageHeight = 0; //no height padding - tightly packed
-
-		region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT; //the aspect of the buffer to copy
-		region.imageSubresource.mipLevel = 0; //no mipmapping
-		region.imageSubresource.layerCount = 1; //only one shall pass
-
-		region.imageOffset = { 0, 0, 0 }; //start indexes
-		region.imageExtent = { width, height, 1 }; //end indexes
-
-		vkCmdCopyBufferToImage(commandBuffer, buffer, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region); //copy the region of the specified buffer to the specified image
-
-		endSingleTimeCommands(commandBuffer);
+	VkCommandBuffer beginSingleTimeCommands() {
+		return beginCommands(commandPool);
 	}
 
-	VkCommandBuffer beginSingleTimeCommands() {
+	VkCommandBuffer beginCommands(VkCommandPool pool) {
 		VkCommandBufferAllocateInfo allocInfo = {};
 		allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
 		allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY; //primary or secondary buffer - right now only using primary command buffers
 		allocInfo.commandBufferCount = 1; //only one buffer at a time
-		allocInfo.commandPool = commandPool; //the command pool to allocate from - only the one command pool for now
+		allocInfo.commandPool = pool; //graphics or transfer pool, matching the queue it's submitted to
 
 		VkCommandBuffer commandBuffer;
 		vkAllocateCommandBuffers(device, &allocInfo, &commandBuffer); //allocate the command buffer
@@ -1414,23 +4725,11 @@ private:
 		return commandBuffer;
 	}
 
-	void endSingleTimeCommands(VkCommandBuffer commandBuffer) {
-		vkEndCommandBuffer(commandBuffer); //stop recording the buffer
-
-		VkSubmitInfo submitInfo = {};
-		submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-		submitInfo.commandBufferCount = 1; //only one at a time for now
-		submitInfo.pCommandBuffers = &commandBuffer; //the buffer
-
-		vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE); //submit the buffer to the queue
-		vkQueueWaitIdle(graphicsQueue); //wait for it to finish
-
-		vkFreeCommandBuffers(device, commandPool, 1, &commandBuffer); //free the buffer
+	void trasitionImageLayout(VkImage image, VkFormat format, VkImageLayout oldLayout, VkImageLayout newLayout, uint32_t layerCount = 1) {
+		recordLayoutTransition(batchCommands(), image, format, oldLayout, newLayout, layerCount); //goes out with the rest of the batch, no round trip
 	}
 
-	void trasitionImageLayout(VkImage image, VkFormat format, VkImageLayout oldLayout, VkImageLayout newLayout) {
-		VkCommandBuffer commandBuffer = beginSingleTimeCommands();
-
+	void recordLayoutTransition(VkCommandBuffer commandBuffer, VkImage image, VkFormat format, VkImageLayout oldLayout, VkImageLayout newLayout, uint32_t layerCount, uint32_t levelCount = 1) {
 		VkImageMemoryBarrier barrier = {};
 		barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
 		barrier.oldLayout = oldLayout; //specify the old layout
@@ -1447,10 +4746,10 @@ private:
 		} else {
 			barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT; //the aspect of the image to transition
 		}
-		barrier.subresourceRange.baseMipLevel = 0; //no mipmapping
-		barrier.subresourceRange.levelCount = 1; //one level
-		barrier.subresourceRange.baseArrayLayer = 0; //not using an array
-		barrier.subresourceRange.layerCount = 1; //no stereoscopic images or anything
+		barrier.subresourceRange.baseMipLevel = 0; //start at the first mip
+		barrier.subresourceRange.levelCount = levelCount; //every mip moves together
+		barrier.subresourceRange.baseArrayLayer = 0; //start at the first layer
+		barrier.subresourceRange.layerCount = layerCount; //every layer of an array image moves together
 
 		VkPipelineStageFlags srcStage;
 		VkPipelineStageFlags dstStage;
@@ -1466,6 +4765,18 @@ private:
 
 			srcStage = VK_ACCESS_TRANSFER_WRITE_BIT; //wait on the tranfer phase
 			dstStage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT; //hold up the fragment shader
+		} else if (oldLayout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL && newLayout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL) {
+			barrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT; //let earlier draws finish sampling
+			barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT; //before the transfer overwrites texels
+
+			srcStage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+			dstStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+		} else if (oldLayout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL && newLayout == VK_IMAGE_LAYOUT_GENERAL) {
+			barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT; //filled once, then only ever sampled or copied out of
+			barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_TRANSFER_READ_BIT;
+
+			srcStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+			dstStage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT;
 		} else if (oldLayout == VK_IMAGE_LAYOUT_UNDEFINED && newLayout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL) {
 			barrier.srcAccessMask = 0;
 			barrier.dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
@@ -1478,23 +4789,30 @@ private:
 
 
 		vkCmdPipelineBarrier(commandBuffer,	srcStage, dstStage,	0, 0, nullptr, 0, nullptr,1, &barrier);
-
-		endSingleTimeCommands(commandBuffer);
 	}
 
 
 	void createDescriptorPool() {
-		std::array<VkDescriptorPoolSize, 2> poolSizes = {};
+		const uint32_t sets = 2 * MAX_FRAMES_IN_FLIGHT + 1; //the live set, plus up to two replaced per frame (detail images, a grown ubo) while frames in flight still use them
+
+		std::array<VkDescriptorPoolSize, 5> poolSizes = {};
 		poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-		poolSizes[0].descriptorCount = 1;
+		poolSizes[0].descriptorCount = 2 * sets; //the material table and the virtual texture table
 		poolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-		poolSizes[1].descriptorCount = 1;
+		poolSizes[1].descriptorCount = 3 * sets; //texture array, page cache and indirection
+		poolSizes[2].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+		poolSizes[2].descriptorCount = sets; //frame ubo
+		poolSizes[3].type = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
+		poolSizes[3].descriptorCount = MAX_MATERIALS * sets; //detail images
+		poolSizes[4].type = VK_DESCRIPTOR_TYPE_SAMPLER;
+		poolSizes[4].descriptorCount = sets;
 
 		VkDescriptorPoolCreateInfo poolInfo = {};
 		poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+		poolInfo.flags = VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT; //replaced sets go back one by one through the deletion queue
 		poolInfo.poolSizeCount = static_cast<uint32_t>(poolSizes.size());
 		poolInfo.pPoolSizes = poolSizes.data();
-		poolInfo.maxSets = 1;
+		poolInfo.maxSets = sets;
 
 		if (vkCreateDescriptorPool(device, &poolInfo, nullptr, &desPool) != VK_SUCCESS)
 			throw std::runtime_error("Failed to create descriptor pool");
@@ -1502,6 +4820,13 @@ private:
 	}
 
 	void createDescriptorSet() {
+		if (!allocateDescriptorSet(desSet))
+			throw std::runtime_error("Failed to allocate descriptor set");
+
+		writeDescriptorSet(desSet);
+	}
+
+	bool allocateDescriptorSet(VkDescriptorSet &set) {
 		VkDescriptorSetLayout layouts[] = { desSetLayout };
 		VkDescriptorSetAllocateInfo allocInfo = {};
 		allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
@@ -1509,9 +4834,21 @@ private:
 		allocInfo.descriptorSetCount = 1;
 		allocInfo.pSetLayouts = layouts;
 
-		if (vkAllocateDescriptorSets(device, &allocInfo, &desSet) != VK_SUCCESS)
-			throw std::runtime_error("Failed to allocate descriptor set");
+		return vkAllocateDescriptorSets(device, &allocInfo, &set) == VK_SUCCESS;
+	}
 
+	void swapDescriptorSet(VkDescriptorSet fresh) {
+		//a set can't be written while recorded command buffers use it, so changes go into a fresh one and the old one is freed once frames using it finish
+		writeDescriptorSet(fresh);
+
+		VkDescriptorSet old = desSet;
+		deferDestroy([this, old] { vkFreeDescriptorSets(device, desPool, 1, &old); }, gpuNow());
+		desSet = fresh;
+
+		markDrawsDirty(0, drawList.size()); //every segment binds it
+	}
+
+	void writeDescriptorSet(VkDescriptorSet set) {
 		VkDescriptorBufferInfo bufferInfo = {};
 		bufferInfo.buffer = uniformBuffer;
 		bufferInfo.offset = 0;
@@ -1522,19 +4859,39 @@ private:
 		imageInfo.imageView = texImgView;
 		imageInfo.sampler = texSampler;
 
-		std::array<VkWriteDescriptorSet, 2> desWrites = {};
+		VkDescriptorBufferInfo materialInfo = {};
+		materialInfo.buffer = materialBuffer;
+		materialInfo.offset = 0;
+		materialInfo.range = sizeof(Material) * MAX_MATERIALS;
+
+		VkDescriptorBufferInfo vtInfo = {};
+		vtInfo.buffer = vtInfoBuffer;
+		vtInfo.offset = 0;
+		vtInfo.range = sizeof(VirtualTextureInfo) * MAX_VIRTUAL_TEXTURES;
+
+		VkDescriptorImageInfo vtCacheInfo = {};
+		vtCacheInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+		vtCacheInfo.imageView = vtCacheImgView;
+		vtCacheInfo.sampler = vtCacheSampler;
+
+		VkDescriptorImageInfo vtIndirectionInfo = {};
+		vtIndirectionInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+		vtIndirectionInfo.imageView = vtIndirectionImgView;
+		vtIndirectionInfo.sampler = vtIndirectionSampler;
+
+		std::array<VkWriteDescriptorSet, 8> desWrites = {};
 		desWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-		desWrites[0].dstSet = desSet;
+		desWrites[0].dstSet = set;
 		desWrites[0].dstBinding = 0;
 		desWrites[0].dstArrayElement = 0;
-		desWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+		desWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 		desWrites[0].descriptorCount = 1;
 		desWrites[0].pBufferInfo = &bufferInfo;
 		desWrites[0].pImageInfo = nullptr;
 		desWrites[0].pTexelBufferView = nullptr;
 
 		desWrites[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-		desWrites[1].dstSet = desSet;
+		desWrites[1].dstSet = set;
 		desWrites[1].dstBinding = 1;
 		desWrites[1].dstArrayElement = 0;
 		desWrites[1].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;;
@@ -1543,96 +4900,422 @@ private:
 		desWrites[1].pImageInfo = &imageInfo;
 		desWrites[1].pTexelBufferView = nullptr;
 
+		desWrites[2].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		desWrites[2].dstSet = set;
+		desWrites[2].dstBinding = 2;
+		desWrites[2].dstArrayElement = 0;
+		desWrites[2].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+		desWrites[2].descriptorCount = 1;
+		desWrites[2].pBufferInfo = &materialInfo;
+		desWrites[2].pImageInfo = nullptr;
+		desWrites[2].pTexelBufferView = nullptr;
+
+		desWrites[3].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		desWrites[3].dstSet = set;
+		desWrites[3].dstBinding = 3;
+		desWrites[3].dstArrayElement = 0;
+		desWrites[3].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+		desWrites[3].descriptorCount = 1;
+		desWrites[3].pBufferInfo = &vtInfo;
+		desWrites[3].pImageInfo = nullptr;
+		desWrites[3].pTexelBufferView = nullptr;
+
+		desWrites[4].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		desWrites[4].dstSet = set;
+		desWrites[4].dstBinding = 4;
+		desWrites[4].dstArrayElement = 0;
+		desWrites[4].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+		desWrites[4].descriptorCount = 1;
+		desWrites[4].pBufferInfo = nullptr;
+		desWrites[4].pImageInfo = &vtCacheInfo;
+		desWrites[4].pTexelBufferView = nullptr;
+
+		desWrites[5].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		desWrites[5].dstSet = set;
+		desWrites[5].dstBinding = 5;
+		desWrites[5].dstArrayElement = 0;
+		desWrites[5].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+		desWrites[5].descriptorCount = 1;
+		desWrites[5].pBufferInfo = nullptr;
+		desWrites[5].pImageInfo = &vtIndirectionInfo;
+		desWrites[5].pTexelBufferView = nullptr;
+
+		std::vector<VkDescriptorImageInfo> detailInfos(MAX_MATERIALS); //every slot needs a valid view, materials without a detail image read the fallback
+		for (VkDescriptorImageInfo &info : detailInfos) {
+			info.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+			info.imageView = detailFallbackView;
+			info.sampler = VK_NULL_HANDLE;
+		}
+		for (uint32_t t = 0; t < textureDetails.size(); t++) {
+			if (textureDetails[t].bound.view != VK_NULL_HANDLE) {
+				detailInfos[packedTextures[t].material].imageLayout = VK_IMAGE_LAYOUT_GENERAL; //see rebuildDetailImage
+				detailInfos[packedTextures[t].material].imageView = textureDetails[t].bound.view;
+			}
+		}
+
+		desWrites[6].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		desWrites[6].dstSet = set;
+		desWrites[6].dstBinding = 6;
+		desWrites[6].dstArrayElement = 0;
+		desWrites[6].descriptorType = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
+		desWrites[6].descriptorCount = MAX_MATERIALS;
+		desWrites[6].pBufferInfo = nullptr;
+		desWrites[6].pImageInfo = detailInfos.data();
+		desWrites[6].pTexelBufferView = nullptr;
+
+		VkDescriptorImageInfo detailSamplerInfo = {};
+		detailSamplerInfo.sampler = detailSampler;
+
+		desWrites[7].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		desWrites[7].dstSet = set;
+		desWrites[7].dstBinding = 7;
+		desWrites[7].dstArrayElement = 0;
+		desWrites[7].descriptorType = VK_DESCRIPTOR_TYPE_SAMPLER;
+		desWrites[7].descriptorCount = 1;
+		desWrites[7].pBufferInfo = nullptr;
+		desWrites[7].pImageInfo = &detailSamplerInfo;
+		desWrites[7].pTexelBufferView = nullptr;
+
 		vkUpdateDescriptorSets(device, static_cast<uint32_t>(desWrites.size()), desWrites.data(), 0, nullptr);
 
 
 	}
 
 	void createCommandBuffers() {
-		commandBuffers.resize(swapChainFramebuffers.size());
+		if (commandBuffers.empty()) { //the frame primaries don't depend on the swapchain, they outlive a resize
+			commandBuffers.resize(framesInFlight);
+
+			VkCommandBufferAllocateInfo cmbAlloc = {};
+			cmbAlloc.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+			cmbAlloc.commandPool = commandPool;
+			cmbAlloc.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+			cmbAlloc.commandBufferCount = (uint32_t)commandBuffers.size();
+
+			if (vkAllocateCommandBuffers(device, &cmbAlloc, commandBuffers.data()) != VK_SUCCESS)
+				throw std::runtime_error("Failed to allocate command buffers.");
+		}
+
+		recordSegments.clear();
+		addRecordSegments(0); //nothing is recorded until a frame needs it
+	}
+
+	void addRecordSegments(size_t firstDraw) { //covers drawList from firstDraw on with new segments
+		size_t workers = recordWorkers.size();
+		size_t segmentDraws = std::max<size_t>(1, std::min(RECORD_SEGMENT_DRAWS, (drawList.size() + workers - 1) / workers)); //at least one segment per worker when there's enough to go round
 
 		VkCommandBufferAllocateInfo cmbAlloc = {};
 		cmbAlloc.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-		cmbAlloc.commandPool = commandPool;
-		cmbAlloc.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-		cmbAlloc.commandBufferCount = (uint32_t)commandBuffers.size();
+		cmbAlloc.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+		cmbAlloc.commandBufferCount = static_cast<uint32_t>(swapChainFramebuffers.size());
+
+		do { //always at least one segment so the render pass has something to execute
+			RecordSegment segment;
+			segment.firstDraw = firstDraw;
+			segment.drawCount = std::min(segmentDraws, drawList.size() - std::min(firstDraw, drawList.size()));
+			segment.worker = static_cast<uint32_t>(recordSegments.size() % workers);
+			segment.secondaries.resize(swapChainFramebuffers.size());
+			segment.recorded.assign(swapChainFramebuffers.size(), 0);
+
+			cmbAlloc.commandPool = recordWorkers[segment.worker].pool; //allocated here, pools are only used by their worker once recording starts
+			if (vkAllocateCommandBuffers(device, &cmbAlloc, segment.secondaries.data()) != VK_SUCCESS)
+				throw std::runtime_error("Failed to allocate secondary command buffers.");
+
+			firstDraw += segment.drawCount;
+			recordSegments.push_back(std::move(segment));
+		} while (firstDraw < drawList.size());
+	}
+
+	void recordDraws(VkCommandBuffer commandBuffer, size_t firstDraw, size_t endDraw) { //pipeline, buffers and descriptors already bound
+		const glm::mat4 *pushed = nullptr; //push constants persist across draws, only push when the transform changes
+
+		for (size_t d = firstDraw; d < endDraw; d++) {
+			const DrawCommand &draw = drawList[d];
+			if (draw.indexCount == 0) //zero is how a culled or hidden draw is marked
+				continue;
+
+			if (pushed == nullptr || *pushed != draw.transform) {
+				DrawPushConstants constants = { draw.transform, glm::transpose(glm::inverse(draw.transform)) };
+				vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(constants), &constants);
+				pushed = &draw.transform;
+			}
+
+			vkCmdDrawIndexed(commandBuffer, draw.indexCount, 1, draw.firstIndex, 0, 0);
+		}
+	}
+
+	void setDrawTransform(size_t draw, const glm::mat4 &transform) { //moves one object, costs a re-record of its segment rather than a buffer write
+		drawList[draw].transform = transform;
+		markDrawsDirty(draw, 1);
+	}
+
+	void markDrawsDirty(size_t firstDraw, size_t count) { //call after changing, adding or hiding draws - only the segments covering them get re-recorded
+		for (auto &segment : recordSegments)
+			if (firstDraw < segment.firstDraw + segment.drawCount && segment.firstDraw < firstDraw + count)
+				segment.version++;
+
+		const RecordSegment &last = recordSegments.back();
+		if (last.firstDraw + last.drawCount < drawList.size()) //appended draws get segments of their own, the rest stay cached
+			addRecordSegments(last.firstDraw + last.drawCount);
+	}
+
+	void recordFrame(uint32_t imageIndex) { //re-records the image's stale segments, then the frame's primary around them
+		applyShaderReloads();
+		reapRetiredCompiles();
+		selectScenePipeline();
+		bindDetailImages(); //before anything is recorded against the current set
+
+		std::vector<RecordSegment *> dirty;
+		for (auto &segment : recordSegments)
+			if (segment.recorded[imageIndex] != segment.version)
+				dirty.push_back(&segment);
+
+		if (dirty.size() == 1) { //not worth waking the workers, pools only need to not be used by two threads at once
+			recordSegment(*dirty[0], imageIndex);
+		} else if (!dirty.empty()) {
+			parallelRecord([this, &dirty, imageIndex](uint32_t w) {
+				for (RecordSegment *segment : dirty)
+					if (segment->worker == w)
+						recordSegment(*segment, imageIndex);
+			});
+		}
+		segmentsRecorded += static_cast<uint32_t>(dirty.size());
+
+		VkCommandBuffer commandBuffer = commandBuffers[currentFrame];
+
+		VkCommandBufferBeginInfo beginInfo = {};
+		beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+		beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+		beginInfo.pInheritanceInfo = nullptr;
+
+		vkBeginCommandBuffer(commandBuffer, &beginInfo); //implicitly resets, the slot's fence says the last one is done
+
+		uint32_t uniformOffset = static_cast<uint32_t>(uniformStride * imageIndex); //this image's ubo slot
 
-		if (vkAllocateCommandBuffers(device, &cmbAlloc, commandBuffers.data()) != VK_SUCCESS)
-			throw std::runtime_error("Failed to allocate command buffers.");
+		VkPipeline feedbackPipeline = virtualTextures.empty() ? VK_NULL_HANDLE : readyPipeline(feedbackVariant);
+		if (feedbackPipeline != VK_NULL_HANDLE) //page requests for next frame's streaming, nothing streams until the pipeline has compiled
+			recordFeedbackPass(commandBuffer, uniformOffset, feedbackPipeline);
 
-		for (size_t i = 0; i < commandBuffers.size(); i++) {
-			VkCommandBufferBeginInfo beginInfo = {};
-			beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-			beginInfo.flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
-			beginInfo.pInheritanceInfo = nullptr;
+		VkRenderPassBeginInfo renderPassInfo = {};
+		renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+		renderPassInfo.renderPass = renderPass;
+		renderPassInfo.framebuffer = swapChainFramebuffers[imageIndex];
+		renderPassInfo.renderArea.extent = swapChainExtent;
+		renderPassInfo.renderArea.offset = { 0, 0 };
 
-			vkBeginCommandBuffer(commandBuffers[i], &beginInfo);
+		std::array<VkClearValue, 2> clearValues = {};
+		clearValues[0].color = { 0.0f, 0.0f, 0.0f, 1.0f };
+		clearValues[1].depthStencil = { 1.0f, 0 };
 
-			VkRenderPassBeginInfo renderPassInfo = {};
-			renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-			renderPassInfo.renderPass = renderPass;
-			renderPassInfo.framebuffer = swapChainFramebuffers[i];
-			renderPassInfo.renderArea.extent = swapChainExtent;
-			renderPassInfo.renderArea.offset = { 0, 0 };
+		renderPassInfo.clearValueCount = static_cast<uint32_t>(clearValues.size());
+		renderPassInfo.pClearValues = clearValues.data();
 
-			std::array<VkClearValue, 2> clearValues = {};
-			clearValues[0].color = { 0.0f, 0.0f, 0.0f, 1.0f };
-			clearValues[1].depthStencil = { 1.0f, 0 };
+		vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS); //the draws themselves come from the segments
 
-			renderPassInfo.clearValueCount = static_cast<uint32_t>(clearValues.size());
-			renderPassInfo.pClearValues = clearValues.data();
+		std::vector<VkCommandBuffer> secondaries;
+		secondaries.reserve(recordSegments.size());
+		for (const auto &segment : recordSegments)
+			secondaries.push_back(segment.secondaries[imageIndex]);
+		vkCmdExecuteCommands(commandBuffer, static_cast<uint32_t>(secondaries.size()), secondaries.data());
 
-			vkCmdBeginRenderPass(commandBuffers[i], &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+		vkCmdEndRenderPass(commandBuffer);
 
-			vkCmdBindPipeline(commandBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, graphicsPipeline);
+		if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS)
+			throw std::runtime_error("Failed to record command buffer.");
+	}
+
+	void recordSegment(RecordSegment &segment, uint32_t imageIndex) { //runs on the segment's worker, or the render thread when it's the only one
+		VkCommandBuffer commandBuffer = segment.secondaries[imageIndex];
+
+		VkCommandBufferInheritanceInfo inheritance = {};
+		inheritance.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+		inheritance.renderPass = renderPass;
+		inheritance.subpass = 0;
+		inheritance.framebuffer = swapChainFramebuffers[imageIndex];
+
+		VkCommandBufferBeginInfo beginInfo = {};
+		beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+		beginInfo.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT | VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT; //cached across frames, so it goes into a new primary each time
+		beginInfo.pInheritanceInfo = &inheritance;
+
+		vkBeginCommandBuffer(commandBuffer, &beginInfo); //implicitly resets, the frame that last drew this image has finished
+
+		vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, scenePipeline); //secondaries inherit no state, bind everything again
+		setViewport(commandBuffer, swapChainExtent);
+
+		VkBuffer vertexBuffers[] = { vertexBuffer };
+		VkDeviceSize offsets[] = { 0 };
+		vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
+
+		vkCmdBindIndexBuffer(commandBuffer, indexBuffer, 0, VK_INDEX_TYPE_UINT32);
+
+		uint32_t uniformOffset = static_cast<uint32_t>(uniformStride * imageIndex);
+		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &desSet, 1, &uniformOffset);
+
+		recordDraws(commandBuffer, segment.firstDraw, std::min(segment.firstDraw + segment.drawCount, drawList.size())); //the draw list may have shrunk under the segment
+
+		if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS)
+			throw std::runtime_error("Failed to record secondary command buffer.");
+
+		segment.recorded[imageIndex] = segment.version;
+	}
+
+	void createRecordWorkers() {
+		uint32_t count = std::max(1u, std::thread::hardware_concurrency()); //0 when it can't tell
+		if (const char *threads = std::getenv("RECORD_THREADS"))
+			count = std::max(1u, static_cast<uint32_t>(std::strtoul(threads, nullptr, 10)));
+		count = std::min(count, MAX_RECORD_WORKERS);
+		count = std::min(count, static_cast<uint32_t>(std::max<size_t>(1, drawList.size()))); //no point in a worker with nothing to draw
 
-			VkBuffer vertexBuffers[] = { vertexBuffer };
-			VkDeviceSize offsets[] = { 0 };
-			vkCmdBindVertexBuffers(commandBuffers[i], 0, 1, vertexBuffers, offsets);
+		recordWorkers.resize(count);
 
-			vkCmdBindIndexBuffer(commandBuffers[i], indexBuffer, 0, VK_INDEX_TYPE_UINT32);
+		VkCommandPoolCreateInfo poolInfo = {};
+		poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+		poolInfo.queueFamilyIndex = indicies.graphicsFamily;
+		poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT; //segments are re-recorded one at a time
+
+		for (uint32_t w = 0; w < count; w++)
+			if (vkCreateCommandPool(device, &poolInfo, nullptr, &recordWorkers[w].pool) != VK_SUCCESS)
+				throw std::runtime_error("Failed to create record worker command pool.");
+
+		for (uint32_t w = 1; w < count; w++)
+			recordThreads.push_back(std::thread(&TriangleBasicsApp::recordWorkerLoop, this, w));
+	}
+
+	void recordWorkerLoop(uint32_t worker) {
+		uint64_t seen = 0;
+
+		while (true) {
+			std::function<void(uint32_t)> job;
+			{
+				std::unique_lock<std::mutex> lock(recordMutex);
+				recordWake.wait(lock, [this, &seen] { return recordStop || recordGeneration != seen; });
+				if (recordStop)
+					return;
 
-			vkCmdBindDescriptorSets(commandBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &desSet, 0, nullptr);
+				seen = recordGeneration;
+				job = recordJob;
+			}
 
-			vkCmdDrawIndexed(commandBuffers[i], static_cast<uint32_t>(vIndices.size()), 1, 0, 0, 0);
+			runRecordJob(job, worker);
+		}
+	}
 
-			vkCmdEndRenderPass(commandBuffers[i]);
+	void runRecordJob(const std::function<void(uint32_t)> &job, uint32_t worker) {
+		try {
+			job(worker);
+		} catch (...) {
+			std::lock_guard<std::mutex> lock(recordMutex);
+			if (!recordError)
+				recordError = std::current_exception();
+		}
 
-			if (vkEndCommandBuffer(commandBuffers[i]) != VK_SUCCESS)
-				throw std::runtime_error("Failed to record command buffer " + i);
+		std::lock_guard<std::mutex> lock(recordMutex);
+		if (--recordBusy == 0)
+			recordIdle.notify_one();
+	}
 
+	void parallelRecord(const std::function<void(uint32_t)> &job) { //runs job once per worker and returns when all of them have
+		{
+			std::lock_guard<std::mutex> lock(recordMutex);
+			recordJob = job;
+			recordBusy = static_cast<uint32_t>(recordWorkers.size());
+			recordError = nullptr;
+			recordGeneration++;
 		}
 
+		recordWake.notify_all();
+		runRecordJob(job, 0);
+
+		std::unique_lock<std::mutex> lock(recordMutex);
+		recordIdle.wait(lock, [this] { return recordBusy == 0; });
+
+		if (recordError)
+			std::rethrow_exception(recordError);
+	}
+
+	void stopRecordWorkers() {
+		{
+			std::lock_guard<std::mutex> lock(recordMutex);
+			recordStop = true;
+		}
 
+		recordWake.notify_all();
+		for (auto &thread : recordThreads)
+			thread.join();
+		recordThreads.clear();
 
+		for (auto &worker : recordWorkers)
+			vkDestroyCommandPool(device, worker.pool, nullptr); //frees any secondaries with it
+		recordWorkers.clear();
 	}
 
 
-	void createSemaphores() {
+	void createSyncObjects() {
+		if (const char *frames = std::getenv("FRAMES_IN_FLIGHT"))
+			framesInFlight = std::min(std::max(1u, static_cast<uint32_t>(std::strtoul(frames, nullptr, 10))), MAX_FRAMES_IN_FLIGHT);
+
+		imageAvailableSemaphores.resize(framesInFlight);
+		renderFinishedSemaphores.resize(framesInFlight);
+		inFlightFences.resize(framesInFlight);
+		imagesInFlight.assign(swapChainImages.size(), VK_NULL_HANDLE);
+		slotFrames.assign(framesInFlight, 0);
+
 		VkSemaphoreCreateInfo semaphoreInfo = {};
 		semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
 
-		if (vkCreateSemaphore(device, &semaphoreInfo, nullptr, &imageAvailableSemaphore) != VK_SUCCESS || vkCreateSemaphore(device, &semaphoreInfo, nullptr, &renderFinishedSemaphore) != VK_SUCCESS)
-			throw std::runtime_error("Failed to create semaphores.");
+		VkFenceCreateInfo fenceInfo = {};
+		fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+		fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT; //nothing to wait for the first time a slot is used
+
+		for (uint32_t i = 0; i < framesInFlight; i++) {
+			if (vkCreateSemaphore(device, &semaphoreInfo, nullptr, &imageAvailableSemaphores[i]) != VK_SUCCESS || vkCreateSemaphore(device, &semaphoreInfo, nullptr, &renderFinishedSemaphores[i]) != VK_SUCCESS)
+				throw std::runtime_error("Failed to create semaphores.");
+
+			if (vkCreateFence(device, &fenceInfo, nullptr, &inFlightFences[i]) != VK_SUCCESS)
+				throw std::runtime_error("Failed to create frame fence.");
+		}
 	}
 
 
 	void mainLoop() {
+		if (const char *budget = std::getenv("UPLOAD_BUDGET_KB")) //tune streaming smoothness without a rebuild
+			uploadBytesPerFrame = static_cast<VkDeviceSize>(std::strtoull(budget, nullptr, 10)) * 1024;
+		if (const char *copies = std::getenv("UPLOAD_COPIES"))
+			uploadCopiesPerFrame = std::max(1u, static_cast<uint32_t>(std::strtoul(copies, nullptr, 10)));
 
 		auto times = std::chrono::high_resolution_clock::now();
 		uint32_t frames = 0;
 
-		while (!glfwWindowShouldClose(window)) {
+		while (true) {
+
+			processWindowEvents();
+			if (closeRequested)
+				break;
 
-			glfwPollEvents();
+			if (windowWidth == 0 || windowHeight == 0) { //minimised, nothing to present to
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+				continue;
+			}
 
 			updateUniformBuffer();
+			updateTextureStreaming(); //and whichever mips are now big enough on screen to matter
+			scheduleUploads(); //upload what's loaded, most important first, within the frame's budget
+			retireUploads(); //recycle staging space from uploads the GPU has finished
 			drawFrame();
 
 			frames++;
 
 			if (std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::high_resolution_clock::now() - times).count() >= 1) {
 				std::cout << "Current FPS: " << frames << std::endl;
+
+				if (uploadMetrics.frames > 0 && (uploadMetrics.copies > 0 || uploadMetrics.queueDepth > 0)) {
+					std::cout << "Uploads: " << uploadMetrics.bytes / uploadMetrics.frames / 1024 << "KB/frame avg, " << uploadMetrics.peakFrameBytes / 1024 << "KB peak, "
+						<< uploadMetrics.copies << " copies, " << uploadMetrics.queueDepth << " queued" << std::endl;
+				}
+				if (segmentsRecorded > 0) //a settled scene records nothing but the primaries
+					std::cout << "Re-recorded " << segmentsRecorded << " of " << recordSegments.size() << " draw segments" << std::endl;
+				segmentsRecorded = 0;
+				uploadMetrics = UploadMetrics();
 				frames = 0;
 				times = std::chrono::high_resolution_clock::now();
 			}
@@ -1642,33 +5325,51 @@ private:
 	}
 
 	void drawFrame() {
+		vkWaitForFences(device, 1, &inFlightFences[currentFrame], VK_TRUE, std::numeric_limits<uint64_t>::max()); //the only place the CPU waits on the GPU, and only for the slot it's about to reuse
+		completedFrame = std::max(completedFrame, slotFrames[currentFrame]); //one queue, so everything submitted before it is done too
+		collectDeletions();
+		updateVirtualTextures(currentFrame); //stream in what the slot's feedback pass asked for, its copy is finished now - pages go out with the next scheduleUploads
+
 		uint32_t imageIndex;
-		VkResult res = vkAcquireNextImageKHR(device, swapChain, std::numeric_limits<uint32_t>::max(), imageAvailableSemaphore, VK_NULL_HANDLE, &imageIndex);
+		VkResult res = vkAcquireNextImageKHR(device, swapChain, std::numeric_limits<uint32_t>::max(), imageAvailableSemaphores[currentFrame], VK_NULL_HANDLE, &imageIndex);
 
 		if (res == VK_ERROR_OUT_OF_DATE_KHR) {
-			recreateSwapchain();
+			swapchainStale = true; //recreated with the window events next frame
 			return;
 		} else if (res != VK_SUCCESS && res != VK_SUBOPTIMAL_KHR) {
 			throw std::runtime_error("Failed to acquire swapchain image");
 		}
 
+		if (imagesInFlight[imageIndex] != VK_NULL_HANDLE) //images can come back out of order, make sure the frame that last used this one is done with its ubo slot
+			vkWaitForFences(device, 1, &imagesInFlight[imageIndex], VK_TRUE, std::numeric_limits<uint64_t>::max());
+		imagesInFlight[imageIndex] = inFlightFences[currentFrame];
+
+		recordFrame(imageIndex);
+
+		flushUploadBatch(); //anything recorded since the last frame has to be on the queue ahead of it
+
+		memcpy(static_cast<unsigned char *>(uniformBufferMemory.mapped) + uniformStride * imageIndex, &frameUbo, sizeof(UniformBufferObject)); //plain store into the mapped slot
+
 		VkSubmitInfo submitInfo = {};
 		submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
 
-		VkSemaphore waitSemaphores[] = { imageAvailableSemaphore };
+		VkSemaphore waitSemaphores[] = { imageAvailableSemaphores[currentFrame] };
 		VkPipelineStageFlags waitStages[] = { VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT };
 		submitInfo.waitSemaphoreCount = 1;
 		submitInfo.pWaitSemaphores = waitSemaphores;
 		submitInfo.pWaitDstStageMask = waitStages;
 		submitInfo.commandBufferCount = 1;
-		submitInfo.pCommandBuffers = &commandBuffers[imageIndex];
+		submitInfo.pCommandBuffers = &commandBuffers[currentFrame];
 
-		VkSemaphore signalSemaphores[] = { renderFinishedSemaphore };
+		VkSemaphore signalSemaphores[] = { renderFinishedSemaphores[currentFrame] };
 		submitInfo.signalSemaphoreCount = 1;
 		submitInfo.pSignalSemaphores = signalSemaphores;
 
-		if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE) != VK_SUCCESS)
+		vkResetFences(device, 1, &inFlightFences[currentFrame]);
+
+		if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, inFlightFences[currentFrame]) != VK_SUCCESS)
 			throw std::runtime_error("Failed to submit draw command buffer");
+		slotFrames[currentFrame] = ++frameNumber;
 
 		VkPresentInfoKHR presentInfo = {};
 		presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
@@ -1681,10 +5382,13 @@ private:
 		presentInfo.pImageIndices = &imageIndex;
 		presentInfo.pResults = nullptr;
 
-		vkQueuePresentKHR(presentQueue, &presentInfo);
-		vkQueueWaitIdle(presentQueue);
-
+		res = vkQueuePresentKHR(presentQueue, &presentInfo);
+		if (res == VK_ERROR_OUT_OF_DATE_KHR || res == VK_SUBOPTIMAL_KHR)
+			swapchainStale = true;
+		else if (res != VK_SUCCESS)
+			throw std::runtime_error("Failed to present swapchain image");
 
+		currentFrame = (currentFrame + 1) % framesInFlight;
 	}
 
 	void updateUniformBuffer() {
@@ -1694,86 +5398,253 @@ private:
 		float time = std::chrono::duration<float, std::chrono::seconds::period>(currentTime - startTime).count();
 
 		UniformBufferObject ubo = {};
-		ubo.model = glm::rotate(glm::mat4(1.0f), time * glm::radians(90.0f), glm::vec3(0.0f, 1.0f, 0.0f));
-		ubo.view = glm::lookAt(glm::vec3(4.0f, 4.0f, 4.0f), glm::vec3(0.0f, 2.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
-		ubo.proj = glm::perspective(glm::radians(45.0f), swapChainExtent.width / (float)swapChainExtent.height, 0.1f, 10.0f);
+		glm::mat4 spin = glm::rotate(glm::mat4(1.0f), time * glm::radians(90.0f), glm::vec3(0.0f, 1.0f, 0.0f)); //the whole scene turns, so it lives in the view rather than every draw's transform
+		ubo.view = glm::lookAt(glm::vec3(4.0f, 4.0f, 4.0f), glm::vec3(0.0f, 2.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f)) * spin;
+		glm::mat4 proj = glm::perspective(glm::radians(45.0f), swapChainExtent.width / (float)swapChainExtent.height, 0.1f, 10.0f);
 
-		ubo.proj[1][1] *= -1;
+		proj[1][1] *= -1;
 
-		ubo.proj *= ubo.view * ubo.model;
+		frameModelView = ubo.view; //texture streaming sizes things on screen with these
+		frameProjection = proj;
 
-		void *data;
-		vkMapMemory(device, uniformBufferMemory, 0, sizeof(UniformBufferObject), 0, &data);
-		memcpy(data, &ubo, sizeof(UniformBufferObject));
-		vkUnmapMemory(device, uniformBufferMemory);
-	}
+		ubo.viewProj = proj * ubo.view;
 
-	void cleanupSwapChain() {
-		vkDestroyImageView(device, depthImgView, nullptr);
-		vkDestroyImage(device, depthImage, nullptr);
-		vkFreeMemory(device, depthImageMem, nullptr); //free the device memory
+		ubo.ambient = glm::vec4(sceneLighting.ambient, 0.0f);
+		ubo.lightIntensity = glm::vec4(sceneLighting.intensity, 0.0f);
+		ubo.lightDirection = glm::vec4(glm::normalize(sceneLighting.direction), 0.0f);
+
+		frameUbo = ubo; //drawFrame stores it once it knows which image, and so which slot, the frame gets
+	}
 
+	void retireSwapChain() { //queues every size dependent object for destruction once the frames using it finish, pipelines and render passes don't depend on the size and stay
+		GpuTimepoint inUse = gpuNow();
 
 		for (auto framebuffer : swapChainFramebuffers)
-			vkDestroyFramebuffer(device, framebuffer, nullptr);
+			deferDestroyFramebuffer(framebuffer, inUse);
 
-		vkFreeCommandBuffers(device, commandPool, static_cast<uint32_t>(commandBuffers.size()), commandBuffers.data());
+		for (auto imageView : swapChainImageViews)
+			deferDestroyImageView(imageView, inUse);
 
-		vkDestroyPipeline(device, graphicsPipeline, nullptr);
+		deferDestroyImageView(depthImgView, inUse);
+		deferDestroyImage(depthImage, depthImageMem, inUse);
 
-		vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
+		for (auto &segment : recordSegments) //they bake in the framebuffers
+			deferFreeCommandBuffers(recordWorkers[segment.worker].pool, std::move(segment.secondaries), inUse);
+		recordSegments.clear();
 
-		vkDestroyRenderPass(device, renderPass, nullptr);
+		retireFeedbackTargets();
 
-		for (auto imageView : swapChainImageViews)
-			vkDestroyImageView(device, imageView, nullptr);
+		deferDestroySwapchain(swapChain, inUse);
+	}
 
-		vkDestroySwapchainKHR(device, swapChain, nullptr);
+	void cleanupSwapChain() { //only once the device is idle
+		retireSwapChain();
+		flushDeletions();
 	}
 
-	void recreateSwapchain() {
-		vkDeviceWaitIdle(device);
+	void recreateSwapchain() { //no wait for idle, frames still in flight keep drawing into what they were recorded against
+		flushUploadBatch(); //keep uploads ordered ahead of the first frame on the new swapchain
 
-		cleanupSwapChain();
+		VkFormat oldFormat = swapChainImageFormat;
+		VkSwapchainKHR oldSwapChain = swapChain;
 
-		createSwapChain();
+		retireSwapChain(); //nothing is destroyed before the next collectDeletions, so the old swapchain is still valid below
+
+		createSwapChain(oldSwapChain);
 		createImageViews();
-		createRenderPass();
-		createGraphicsPipeline();
+
+		if (swapChainImageFormat != oldFormat) { //only happens when the surface itself changes, e.g. moving to an hdr monitor
+			std::vector<PipelineVariant> stale; //keyed on the old pass, a recycled handle value could otherwise hand them out for the new one
+			for (const auto &entry : pipelineVariants)
+				if (entry.first.pass == renderPass)
+					stale.push_back(entry.first);
+			for (const auto &variant : stale)
+				retirePipelineVariant(variant);
+
+			deferDestroyPipeline(graphicsPipeline, gpuNow());
+			deferDestroyRenderPass(renderPass, gpuNow());
+			createRenderPass();
+			graphicsPipeline = buildGraphicsPipeline("shaders/vert.spv", "shaders/frag.spv", renderPass, lightingSpecialization(LIGHTING_UNIFORM));
+			scenePipeline = VK_NULL_HANDLE; //picked again for the new pass next frame
+		}
+
 		createDepthResources();
 		createFrameBuffer();
+		createFeedbackTargets();
+		growUniformBuffer();
 		createCommandBuffers();
 
+		imagesInFlight.resize(swapChainImages.size(), VK_NULL_HANDLE); //ubo slots are per image index, so old fences still guard the slots they were guarding
+	}
+
+	GpuTimepoint gpuNow() const { //covers everything submitted so far, and the open upload batch
+		return { frameNumber, uploadSerial + (uploadBatch != VK_NULL_HANDLE || streamingRecording ? 1 : 0) };
+	}
+
+	bool gpuReached(const GpuTimepoint &timepoint) const {
+		return completedFrame >= timepoint.frame && completedUpload >= timepoint.upload;
+	}
+
+	void deferDestroy(std::function<void()> destroy, GpuTimepoint after) { //for anything the typed helpers below don't cover
+		deletionQueue.push_back({ after, std::move(destroy) });
+	}
+
+	void deferDestroyBuffer(VkBuffer buffer, MemoryAllocation memory, GpuTimepoint after) {
+		deferDestroy([this, buffer, memory]() mutable {
+			vkDestroyBuffer(device, buffer, nullptr);
+			memoryAllocator.free(memory);
+		}, after);
+	}
+
+	void deferDestroyImage(VkImage image, MemoryAllocation memory, GpuTimepoint after) {
+		deferDestroy([this, image, memory]() mutable {
+			vkDestroyImage(device, image, nullptr);
+			memoryAllocator.free(memory); //free the device memory
+		}, after);
+	}
+
+	void deferDestroyImageView(VkImageView imageView, GpuTimepoint after) {
+		deferDestroy([this, imageView] { vkDestroyImageView(device, imageView, nullptr); }, after);
+	}
+
+	void deferDestroyFramebuffer(VkFramebuffer framebuffer, GpuTimepoint after) {
+		deferDestroy([this, framebuffer] { vkDestroyFramebuffer(device, framebuffer, nullptr); }, after);
+	}
+
+	void deferDestroySampler(VkSampler sampler, GpuTimepoint after) {
+		deferDestroy([this, sampler] { vkDestroySampler(device, sampler, nullptr); }, after);
+	}
+
+	void deferDestroyPipeline(VkPipeline pipeline, GpuTimepoint after) {
+		deferDestroy([this, pipeline] { vkDestroyPipeline(device, pipeline, nullptr); }, after);
+	}
+
+	void deferDestroyRenderPass(VkRenderPass pass, GpuTimepoint after) {
+		deferDestroy([this, pass] { vkDestroyRenderPass(device, pass, nullptr); }, after);
+	}
+
+	void deferDestroySwapchain(VkSwapchainKHR oldSwapChain, GpuTimepoint after) {
+		deferDestroy([this, oldSwapChain] { vkDestroySwapchainKHR(device, oldSwapChain, nullptr); }, after);
+	}
+
+	void deferFreeCommandBuffers(VkCommandPool pool, std::vector<VkCommandBuffer> buffers, GpuTimepoint after) { //collected on the render thread, so the record workers' pools are safe to free into
+		if (buffers.empty())
+			return;
+
+		auto shared = std::make_shared<std::vector<VkCommandBuffer>>(std::move(buffers)); //std::function needs a copyable capture
+		deferDestroy([this, pool, shared] { vkFreeCommandBuffers(device, pool, static_cast<uint32_t>(shared->size()), shared->data()); }, after);
+	}
+
+	void collectDeletions() { //destroys whatever the GPU has finished with, never blocks
+		for (auto it = deletionQueue.begin(); it != deletionQueue.end();) {
+			if (gpuReached(it->after)) {
+				it->destroy();
+				it = deletionQueue.erase(it);
+			} else {
+				++it;
+			}
+		}
+	}
+
+	void flushDeletions() { //only once the device is idle
+		for (auto &pending : deletionQueue)
+			pending.destroy();
+		deletionQueue.clear();
 	}
 
 
 	void cleanup() {
 
-		vkDestroySemaphore(device, renderFinishedSemaphore, nullptr);
-		vkDestroySemaphore(device, imageAvailableSemaphore, nullptr);
+		stopShaderWatcher();
+		stopVirtualTextureLoader();
+		stopMipStreamLoader();
+		finishUploads();
+
+		for (uint32_t i = 0; i < framesInFlight; i++) {
+			vkDestroySemaphore(device, renderFinishedSemaphores[i], nullptr);
+			vkDestroySemaphore(device, imageAvailableSemaphores[i], nullptr);
+			vkDestroyFence(device, inFlightFences[i], nullptr);
+		}
+
+		for (auto &detail : textureDetails) { //the flush below destroys them with everything else retired
+			if (detail.newest.image != detail.bound.image)
+				retireDetailImage(detail.newest, gpuNow());
+			if (detail.bound.image != VK_NULL_HANDLE)
+				retireDetailImage(detail.bound, gpuNow());
+		}
+		textureDetails.clear();
 
 		cleanupSwapChain(); //destroy swapchain components
 
+		for (auto &reload : reloadingPipelines) //same for reloads that never got swapped in
+			destroyCompiledPipeline(reload.future);
+		reloadingPipelines.clear();
+
+		destroyPipelineVariants(); //before the passes and layout a compile still in flight is using
+
+		cleanupFeedbackPass();
+
+		vkDestroyPipeline(device, graphicsPipeline, nullptr);
+
+		vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
+
+		savePipelineCache();
+		vkDestroyPipelineCache(device, pipelineCache, nullptr);
+
+		vkDestroyRenderPass(device, renderPass, nullptr);
+
 		vkDestroySampler(device, texSampler, nullptr); //destroy texture sampler
 
+		vkDestroySampler(device, detailSampler, nullptr);
+		vkDestroyImageView(device, detailFallbackView, nullptr);
+		vkDestroyImage(device, detailFallbackImage, nullptr);
+		memoryAllocator.free(detailFallbackMem);
+
 		vkDestroyImageView(device, texImgView, nullptr); //destroy texture image view
 
 		vkDestroyImage(device, texImage, nullptr); //destroy texture image
-		vkFreeMemory(device, texImageMem, nullptr); //free the device memory
+		memoryAllocator.free(texImageMem); //free the device memory
+
+		vkDestroySampler(device, vtIndirectionSampler, nullptr);
+		vkDestroySampler(device, vtCacheSampler, nullptr);
+		vkDestroyImageView(device, vtIndirectionImgView, nullptr);
+		vkDestroyImage(device, vtIndirectionImage, nullptr);
+		memoryAllocator.free(vtIndirectionImageMem);
+		vkDestroyImageView(device, vtCacheImgView, nullptr);
+		vkDestroyImage(device, vtCacheImage, nullptr);
+		memoryAllocator.free(vtCacheImageMem);
 
 		vkDestroyDescriptorSetLayout(device, desSetLayout, nullptr);
 
 		vkDestroyDescriptorPool(device, desPool, nullptr);
-		vkDestroyCommandPool(device, commandPool, nullptr);
+
+		stopRecordWorkers();
+		vkDestroyCommandPool(device, commandPool, nullptr); //frees the frame primaries with it
+		if (transferCommandPool != VK_NULL_HANDLE)
+			vkDestroyCommandPool(device, transferCommandPool, nullptr);
+
+		vkDestroyBuffer(device, stagingBuffer, nullptr);
+		memoryAllocator.free(stagingBufferMemory);
+		if (landingBuffer != VK_NULL_HANDLE)
+			vkDestroyBuffer(device, landingBuffer, nullptr);
+		memoryAllocator.free(landingBufferMemory);
 
 		vkDestroyBuffer(device, indexBuffer, nullptr);
-		vkFreeMemory(device, indexBufferMemory, nullptr);
+		memoryAllocator.free(indexBufferMemory);
 
 		vkDestroyBuffer(device, vertexBuffer, nullptr);
-		vkFreeMemory(device, vertexBufferMemory, nullptr);
+		memoryAllocator.free(vertexBufferMemory);
 
 		vkDestroyBuffer(device, uniformBuffer, nullptr);
-		vkFreeMemory(device, uniformBufferMemory, nullptr);
+		memoryAllocator.free(uniformBufferMemory);
+
+		vkDestroyBuffer(device, materialBuffer, nullptr);
+		memoryAllocator.free(materialBufferMemory);
+
+		vkDestroyBuffer(device, vtInfoBuffer, nullptr);
+		memoryAllocator.free(vtInfoBufferMemory);
+
+		memoryAllocator.destroy();
 
 		DestroyDebugReportCallbackEXT(instance, callback, nullptr);
 
@@ -1781,10 +5652,6 @@ private:
 
 		vkDestroyInstance(instance, nullptr);
 
-		glfwDestroyWindow(window);
-
-		glfwTerminate();
-
 	}
 };
 